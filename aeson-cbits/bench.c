@@ -0,0 +1,521 @@
+// Throughput of every decoder kernel of the library (see dispatch.c) on
+// generated corpora of several shapes and sizes, or on files.
+//
+//   bench [-s SHAPES] [-z SIZES] [-k KERNELS] [-j THREADS] [-f FILE]...
+//         [-m BYTES] [-o RESULTS] [-b BASELINE] [-t TOL]
+//
+// SHAPES, SIZES and KERNELS are comma-separated lists (default: all shapes,
+// 16 bytes to 64 MB, all kernels the CPU can run); sizes take K and M
+// suffixes. Each measure decodes at least BYTES bytes (default 64M), best
+// of three. Every kernel must give the output of the table kernel, else the
+// exit status is 1. The ascii kernel only runs on ASCII corpora.
+// For each number of threads in the list THREADS, _js_decode_string_parallel
+// is measured too (with the kernel chosen at load time), as kernel
+// "parallel<THREADS>".
+// The keys shape is made of short strings: each kernel decodes them with one
+// call per string, as a batch (kernel "<kernel>.batch", plus
+// "batch-parallel<THREADS>") and zero-copy ("<kernel>.view": only the
+// strings with escapes are decoded, the others only validated); the time per
+// string is shown too.
+//
+// Results (shape size kernel gbps cycles_per_byte) are written as TSV to
+// RESULTS, and compared with BASELINE if given: a drop of more than TOL
+// (default 0.1, i.e. 10%) in GB/s is a regression (exit status 1).
+// Cycles are those of the time-stamp counter (x86 only, "-" elsewhere).
+// Small corpora are decoded over and over, long enough for the branch
+// predictor to learn them: irregular shapes look faster than they are.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "unescape_string.h"
+
+static const char *const shapes[] = {
+  "ascii",      // printable ASCII, no escapes
+  "latin",      // Latin text: some two-byte sequences, a few escapes
+  "cjk",        // three-byte sequences with some ASCII
+  "emoji",      // four-byte sequences (astral) with some ASCII
+  "escapes",    // two-character escapes every few bytes
+  "surrogates", // \uXXXX escapes, mostly surrogate pairs
+  "keys",       // object keys of 8 to 32 bytes, one call or batch (below)
+};
+
+#define NSHAPES (sizeof shapes / sizeof *shapes)
+
+static uint64_t rng = 44;
+
+static uint32_t next(void)
+{
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng >> 32;
+}
+
+static size_t put_utf8(uint8_t *d, uint32_t c)
+{
+  if (c < 0x80) {
+    d[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    d[0] = 0xc0 | (c >> 6);
+    d[1] = 0x80 | (c & 0x3f);
+    return 2;
+  } else if (c < 0x10000) {
+    d[0] = 0xe0 | (c >> 12);
+    d[1] = 0x80 | ((c >> 6) & 0x3f);
+    d[2] = 0x80 | (c & 0x3f);
+    return 3;
+  }
+  d[0] = 0xf0 | (c >> 18);
+  d[1] = 0x80 | ((c >> 12) & 0x3f);
+  d[2] = 0x80 | ((c >> 6) & 0x3f);
+  d[3] = 0x80 | (c & 0x3f);
+  return 4;
+}
+
+static size_t put_hex(uint8_t *d, uint32_t u)
+{
+  return sprintf((char *) d, "\\u%04X", u);
+}
+
+// One unit (character or escape) of the given shape at d, return its length
+// (at most 12 bytes).
+static size_t unit(uint8_t *d, const char *shape)
+{
+  uint32_t r = next();
+  uint32_t printable = 'a' + r % 26;
+  if (!strcmp(shape, "latin")) {
+    if (r % 100 < 15)
+      return put_utf8(d, 0xc0 + (r >> 8) % 0x40);
+    if (r % 100 < 17)
+      return sprintf((char *) d, "\\n");
+  } else if (!strcmp(shape, "cjk")) {
+    if (r % 100 < 90)
+      return put_utf8(d, 0x4e00 + (r >> 8) % 0x5200);
+  } else if (!strcmp(shape, "emoji")) {
+    if (r % 100 < 80)
+      return put_utf8(d, 0x1f300 + (r >> 8) % 0x350);
+  } else if (!strcmp(shape, "escapes")) {
+    if (r % 2) {
+      d[0] = '\\';
+      d[1] = "nt\"\\/brf"[(r >> 8) % 8];
+      return 2;
+    }
+  } else if (!strcmp(shape, "surrogates")) {
+    uint32_t c = 0x10000 + (r >> 8) % 0x100000;
+    if (r % 100 < 20)
+      return put_hex(d, 0x4e00 + (r >> 8) % 0x5200);
+    return put_hex(d, 0xD800 + ((c - 0x10000) >> 10))
+      + put_hex(d + 6, 0xDC00 + (c & 0x3ff));
+  }
+  d[0] = printable;
+  return 1;
+}
+
+static void generate(uint8_t *s, size_t size, const char *shape)
+{
+  uint8_t u[16];
+  size_t i = 0;
+  rng = 44;
+  while (i < size) {
+    size_t n = unit(u, shape);
+    if (i + n > size) {
+      // No room for a whole unit
+      memset(s + i, 'a', size - i);
+      break;
+    }
+    memcpy(s + i, u, n);
+    i += n;
+  }
+}
+
+static uint8_t *load(const char *file, size_t *size)
+{
+  FILE *f = fopen(file, "rb");
+  if (!f) {
+    perror(file);
+    exit(2);
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  rewind(f);
+  uint8_t *s = malloc(*size ? *size : 1);
+  if (fread(s, 1, *size, f) != *size) {
+    perror(file);
+    exit(2);
+  }
+  fclose(f);
+  return s;
+}
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// In a comma-separated list (NULL: any)
+static int listed(const char *list, const char *name)
+{
+  if (!list)
+    return 1;
+  size_t n = strlen(name);
+  for (const char *p = list; p; p = strchr(p, ',')) {
+    if (*p == ',')
+      p++;
+    if (!strncmp(p, name, n) && (p[n] == ',' || !p[n]))
+      return 1;
+  }
+  return 0;
+}
+
+static size_t parse_size(const char *s)
+{
+  char *end;
+  size_t n = strtoull(s, &end, 10);
+  if (*end == 'K' || *end == 'k')
+    n <<= 10;
+  else if (*end == 'M' || *end == 'm')
+    n <<= 20;
+  return n;
+}
+
+typedef struct {
+  char key[128]; // shape size kernel
+  double gbps;
+} result;
+
+static result *baseline;
+static size_t nbaseline;
+
+static void load_baseline(const char *file)
+{
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    perror(file);
+    exit(2);
+  }
+  char line[256], shape[64], kernel[32];
+  size_t size;
+  double gbps;
+  while (fgets(line, sizeof line, f))
+    if (sscanf(line, "%63s %zu %31s %lf", shape, &size, kernel, &gbps) == 4) {
+      baseline = realloc(baseline, (nbaseline + 1) * sizeof *baseline);
+      snprintf(baseline[nbaseline].key, sizeof baseline->key, "%s %zu %s",
+               shape, size, kernel);
+      baseline[nbaseline++].gbps = gbps;
+    }
+  fclose(f);
+}
+
+static int regressions, mismatches;
+
+typedef int (*decode_fn)(uint16_t *, size_t *, const uint8_t *,
+                         const uint8_t *);
+
+static unsigned threads;
+
+static int parallel(uint16_t *dest, size_t *destoff, const uint8_t *s,
+                    const uint8_t *srcend)
+{
+  return _js_decode_string_parallel(dest, destoff, s, srcend, threads);
+}
+
+// Strings of the keys shape, which cover the corpus
+static js_span *spans;
+static size_t nspans;
+static uint64_t *errors;
+static const js_kernel *kernel;
+
+static int calls(uint16_t *dest, size_t *destoff, const uint8_t *s,
+                 const uint8_t *srcend)
+{
+  for (size_t i = 0; i < nspans; i++) {
+    spans[i].offset = *destoff;
+    if (kernel->decode_string(dest, destoff, spans[i].s,
+                              spans[i].s + spans[i].len))
+      return -1;
+    spans[i].length = *destoff - spans[i].offset;
+  }
+  return 0;
+}
+
+// Zero-copy: a string without escapes is only validated, its view would be
+// handed out. The output is only complete when checking: the views are then
+// decoded too.
+static int checking;
+
+static int views(uint16_t *dest, size_t *destoff, const uint8_t *s,
+                 const uint8_t *srcend)
+{
+  for (size_t i = 0; i < nspans; i++) {
+    const uint8_t *p = spans[i].s, *end = p + spans[i].len;
+    int r = kernel->validate_string(p, end);
+    if (r < 0)
+      return -1;
+    spans[i].offset = *destoff;
+    if ((r || checking) && kernel->decode_string(dest, destoff, p, end))
+      return -1;
+    spans[i].length = *destoff - spans[i].offset;
+  }
+  return 0;
+}
+
+static int batch_end(uint16_t *dest, size_t *destoff, size_t failed)
+{
+  if (failed)
+    return -1;
+  *destoff += spans[nspans - 1].offset + spans[nspans - 1].length;
+  return 0;
+}
+
+static int batch(uint16_t *dest, size_t *destoff, const uint8_t *s,
+                 const uint8_t *srcend)
+{
+  return batch_end(dest, destoff, kernel->decode_batch(spans, nspans,
+                                                       dest + *destoff,
+                                                       errors));
+}
+
+static int batch_parallel(uint16_t *dest, size_t *destoff, const uint8_t *s,
+                          const uint8_t *srcend)
+{
+  return batch_end(dest, destoff,
+                   _js_decode_batch_parallel(spans, nspans, dest + *destoff,
+                                             errors, threads));
+}
+
+// Keys: identifiers, 3% of them with a Latin letter or an escape
+static void generate_keys(uint8_t *s, size_t size)
+{
+  size_t i = 0;
+  rng = 44;
+  nspans = 0;
+  while (i < size) {
+    size_t len = 8 + next() % 25, start = i;
+    if (len > size - i)
+      len = size - i;
+    uint32_t special = next();
+    while (i - start < len) {
+      uint32_t r = next();
+      if (special % 100 < 2 && len - (i - start) >= 2) {
+        i += put_utf8(s + i, 0xc0 + (r >> 8) % 0x40);
+        special = 100;
+      } else if (special % 100 < 3 && len - (i - start) >= 2) {
+        i += sprintf((char *) s + i, "\\t");
+        special = 100;
+      } else {
+        s[i++] = "abcdefghijklmnopqrstuvwxyz_0123456789"[(r >> 8) % 37];
+      }
+    }
+    spans[nspans].s = s + start;
+    spans[nspans++].len = i - start;
+  }
+}
+
+// Time decode (called name) on s[0..size) against the reference output,
+// record it
+static void measure(const char *name, decode_fn decode, const char *shape,
+                    const uint8_t *s, size_t size, uint16_t *d,
+                    const uint16_t *ref, size_t reflen, size_t bytes,
+                    double tol, FILE *out)
+{
+  size_t ofs = 0;
+  memset(d, 0, (size + 1) * sizeof *d);
+  checking = 1;
+  int r = decode(d, &ofs, s, s + size);
+  checking = 0;
+  if (r || ofs != reflen || memcmp(d, ref, reflen * sizeof *d)) {
+    printf("%-10s %9zu %-10s MISMATCH with table\n", shape, size, name);
+    mismatches++;
+    return;
+  }
+  size_t runs = bytes / (size ? size : 1);
+  if (runs < 1)
+    runs = 1;
+  double best = 0;
+  uint64_t best_cycles = 0;
+  for (int trial = 0; trial < 3; trial++) {
+    double t0 = now();
+    uint64_t c0 = cycles();
+    for (size_t i = 0; i < runs; i++) {
+      ofs = 0;
+      decode(d, &ofs, s, s + size);
+    }
+    uint64_t c1 = cycles();
+    double ns = now() - t0;
+    if (!best || ns < best) {
+      best = ns;
+      best_cycles = c1 - c0;
+    }
+  }
+  double gbps = (double) size * runs / best;
+  char per_string[32] = "";
+  if (decode == calls || decode == views || decode == batch
+      || decode == batch_parallel)
+    snprintf(per_string, sizeof per_string, " %6.1f ns/string",
+             best / runs / nspans);
+  char cpb[32] = "-";
+  if (best_cycles)
+    snprintf(cpb, sizeof cpb, "%.3f", (double) best_cycles / size / runs);
+  printf("%-10s %9zu %-10s %8.3f GB/s %8s cycles/byte%s", shape, size, name,
+         gbps, cpb, per_string);
+  fprintf(out, "%s\t%zu\t%s\t%.3f\t%s\n", shape, size, name, gbps, cpb);
+
+  char key[128];
+  snprintf(key, sizeof key, "%s %zu %s", shape, size, name);
+  for (size_t i = 0; i < nbaseline; i++)
+    if (!strcmp(baseline[i].key, key)) {
+      if (gbps < baseline[i].gbps * (1 - tol)) {
+        printf("  REGRESSION (%.3f)", baseline[i].gbps);
+        regressions++;
+      }
+      break;
+    }
+  printf("\n");
+}
+
+static const js_kernel *automatic;
+
+static void bench(const char *shape, const uint8_t *s, size_t size,
+                  const char *kernels, const char *thread_list,
+                  size_t bytes, double tol, FILE *out)
+{
+  uint16_t *d = malloc((size + 1) * sizeof *d);
+  uint16_t *ref = malloc((size + 1) * sizeof *ref);
+  size_t reflen = 0;
+  if (_js_kernel_select("table") || _js_decode_string(ref, &reflen, s, s + size)) {
+    printf("%-10s %9zu not a valid string, skipped\n", shape, size);
+    free(d);
+    free(ref);
+    return;
+  }
+  int ascii = 1;
+  for (size_t i = 0; i < size; i++)
+    if (s[i] >= 0x80)
+      ascii = 0;
+  int keys = !strcmp(shape, "keys");
+  char name[64];
+  const js_kernel *k;
+  for (size_t i = 0; (kernel = k = _js_kernel_at(i)); i++) {
+    if (!listed(kernels, k->name) || (!ascii && !strcmp(k->name, "ascii")))
+      continue;
+    measure(k->name, keys ? calls : k->decode_string, shape, s, size, d,
+            ref, reflen, bytes, tol, out);
+    if (keys) {
+      snprintf(name, sizeof name, "%s.view", k->name);
+      measure(name, views, shape, s, size, d, ref, reflen, bytes, tol, out);
+      snprintf(name, sizeof name, "%s.batch", k->name);
+      measure(name, batch, shape, s, size, d, ref, reflen, bytes, tol, out);
+    }
+  }
+  _js_kernel_select(automatic->name);
+  for (const char *p = thread_list; p; p = strchr(p, ',')) {
+    if (*p == ',')
+      p++;
+    threads = atoi(p);
+    snprintf(name, sizeof name, "%s%u", keys ? "batch-parallel" : "parallel",
+             threads);
+    measure(name, keys ? batch_parallel : parallel, shape, s, size, d, ref,
+            reflen, bytes, tol, out);
+  }
+  free(d);
+  free(ref);
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [-s SHAPES] [-z SIZES] [-k KERNELS] [-j THREADS] "
+          "[-f FILE]... [-m BYTES] [-o RESULTS] [-b BASELINE] [-t TOL]\n",
+          name);
+  exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *shape_list = NULL, *kernels = NULL, *results = "bench.tsv";
+  const char *thread_list = NULL;
+  const char *sizes = "16,256,4K,64K,1M,16M,64M";
+  const char *files[64];
+  int nfiles = 0;
+  size_t bytes = 64 << 20;
+  double tol = 0.1;
+  int opt;
+  automatic = _js_kernel_current();
+  while ((opt = getopt(argc, argv, "s:z:k:j:f:m:o:b:t:")) != -1)
+    switch (opt) {
+      case 's': shape_list = optarg; break;
+      case 'z': sizes = optarg; break;
+      case 'k': kernels = optarg; break;
+      case 'j': thread_list = optarg; break;
+      case 'f': if (nfiles < 64) files[nfiles++] = optarg; break;
+      case 'm': bytes = parse_size(optarg); break;
+      case 'o': results = optarg; break;
+      case 'b': load_baseline(optarg); break;
+      case 't': tol = atof(optarg); break;
+      default: usage(argv[0]);
+    }
+  if (optind < argc)
+    usage(argv[0]);
+
+  FILE *out = fopen(results, "w");
+  if (!out) {
+    perror(results);
+    return 2;
+  }
+  fprintf(out, "shape\tsize\tkernel\tgbps\tcycles_per_byte\n");
+
+  for (int i = 0; i < nfiles; i++) {
+    size_t size;
+    uint8_t *s = load(files[i], &size);
+    const char *base = strrchr(files[i], '/');
+    bench(base ? base + 1 : files[i], s, size, kernels, thread_list, bytes,
+          tol, out);
+    free(s);
+  }
+  // Generated corpora, unless only files were asked for
+  if (!nfiles || shape_list)
+    for (size_t i = 0; i < NSHAPES; i++) {
+      if (!listed(shape_list, shapes[i]))
+        continue;
+      for (const char *p = sizes; p; p = strchr(p, ',')) {
+        if (*p == ',')
+          p++;
+        size_t size = parse_size(p);
+        uint8_t *s = malloc(size ? size : 1);
+        if (!strcmp(shapes[i], "keys")) {
+          spans = realloc(spans, (size / 8 + 1) * sizeof *spans);
+          errors = realloc(errors, (size / 8 / 64 + 1) * sizeof *errors);
+          generate_keys(s, size);
+        } else {
+          generate(s, size, shapes[i]);
+        }
+        bench(shapes[i], s, size, kernels, thread_list, bytes, tol, out);
+        free(s);
+      }
+    }
+  fclose(out);
+
+  if (mismatches)
+    printf("%d kernel outputs differ from the table kernel\n", mismatches);
+  if (nbaseline)
+    printf(regressions ? "%d regressions against the baseline\n"
+           : "no regression against the baseline\n", regressions);
+  return mismatches || regressions;
+}
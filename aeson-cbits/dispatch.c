@@ -0,0 +1,215 @@
+// Library build of unescape_string.c: every kernel (one object each, built
+// with -DKERNEL=name, see the Makefile) and the selection of one of them at
+// load time, from the features of the CPU.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unescape_string.h"
+
+// Functions of one kernel object
+#define KERNEL_DECLARE(k) \
+  void k##_js_escape_bitmap(const uint8_t *, size_t, uint64_t *); \
+  void k##_js_decoder_init(js_decoder *); \
+  int k##_js_decode_chunk(js_decoder *, uint16_t *, size_t *, \
+                          const uint8_t *, const uint8_t *); \
+  int k##_js_decode_finish(const js_decoder *); \
+  int k##_js_decode_string(uint16_t *, size_t *, \
+                           const uint8_t *, const uint8_t *); \
+  int k##_js_decode_string_bounded(uint16_t *, size_t *, uint16_t *, \
+                                   const uint8_t *, const uint8_t *); \
+  int k##_js_decode_string_bitmap(uint16_t *, size_t *, const uint8_t *, \
+                                  const uint8_t *, const uint64_t *, \
+                                  const uint8_t *); \
+  size_t k##_js_decoded_length(const uint8_t *, const uint8_t *); \
+  int k##_js_unescape_utf8(uint8_t *, size_t *, \
+                           const uint8_t *, const uint8_t *); \
+  int k##_js_validate_string(const uint8_t *, const uint8_t *); \
+  size_t k##_js_decode_batch(js_span *, size_t, uint16_t *, uint64_t *); \
+  int k##_js_escape_utf16(uint8_t *, size_t *, \
+                          const uint16_t *, const uint16_t *, int); \
+  int k##_js_escape_utf8(uint8_t *, size_t *, \
+                         const uint8_t *, const uint8_t *, int);
+
+#define KERNEL_ENTRY(k) { #k, \
+  k##_js_escape_bitmap, k##_js_decoder_init, k##_js_decode_chunk, \
+  k##_js_decode_finish, k##_js_decode_string, k##_js_decode_string_bounded, \
+  k##_js_decode_string_bitmap, k##_js_decoded_length, k##_js_unescape_utf8, \
+  k##_js_validate_string, k##_js_decode_batch, k##_js_escape_utf16, \
+  k##_js_escape_utf8 }
+
+KERNEL_DECLARE(table)
+KERNEL_DECLARE(shift)
+KERNEL_DECLARE(flow)
+KERNEL_DECLARE(ascii)
+#ifdef X86_KERNELS
+KERNEL_DECLARE(sse42)
+KERNEL_DECLARE(avx2)
+KERNEL_DECLARE(avx512)
+#endif
+
+// What a kernel needs from the CPU
+enum cpu_feature {
+  CPU_ANY,
+  CPU_SSE42,
+  CPU_AVX2,
+  CPU_AVX512BW,
+};
+
+static const struct {
+  js_kernel kernel;
+  enum cpu_feature needs;
+  int automatic; // candidate for the automatic selection
+} kernels[] = {
+  // Fastest first
+#ifdef X86_KERNELS
+  { KERNEL_ENTRY(avx512), CPU_AVX512BW, 1 },
+  { KERNEL_ENTRY(avx2), CPU_AVX2, 1 },
+  { KERNEL_ENTRY(sse42), CPU_SSE42, 1 },
+#endif
+  { KERNEL_ENTRY(table), CPU_ANY, 1 }, // PORTABLE
+  { KERNEL_ENTRY(shift), CPU_ANY, 1 },
+  { KERNEL_ENTRY(flow), CPU_ANY, 1 },
+  // Rejects non-ASCII input: only on demand
+  { KERNEL_ENTRY(ascii), CPU_ANY, 0 },
+};
+
+#define NKERNELS (sizeof kernels / sizeof *kernels)
+#ifdef X86_KERNELS
+#define PORTABLE 3
+#else
+#define PORTABLE 0
+#endif
+
+static int supported(enum cpu_feature feature)
+{
+  switch (feature) {
+#ifdef X86_KERNELS
+    // __builtin_cpu_supports only takes string literals
+    case CPU_SSE42:    return __builtin_cpu_supports("sse4.2");
+    case CPU_AVX2:     return __builtin_cpu_supports("avx2");
+    case CPU_AVX512BW: return __builtin_cpu_supports("avx512bw");
+#endif
+    case CPU_ANY:      return 1;
+    default:           return 0;
+  }
+}
+
+// The portable kernel until the constructor has run
+static const js_kernel *current = &kernels[PORTABLE].kernel;
+
+const js_kernel *_js_kernel_at(size_t i)
+{
+  for (size_t k = 0; k < NKERNELS; k++)
+    if (supported(kernels[k].needs) && i-- == 0)
+      return &kernels[k].kernel;
+  return NULL;
+}
+
+const js_kernel *_js_kernel_current(void)
+{
+  return current;
+}
+
+int _js_kernel_select(const char *name)
+{
+  for (size_t k = 0; k < NKERNELS; k++)
+    if (!strcmp(kernels[k].kernel.name, name) && supported(kernels[k].needs)) {
+      current = &kernels[k].kernel;
+      return 0;
+    }
+  return -1;
+}
+
+__attribute__((constructor)) static void select_kernel(void)
+{
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+#endif
+  for (size_t k = 0; k < NKERNELS; k++)
+    if (kernels[k].automatic && supported(kernels[k].needs)) {
+      current = &kernels[k].kernel;
+      break;
+    }
+  // Explicit choice, e.g. for benchmarks
+  const char *name = getenv("JS_DECODE_KERNEL");
+  if (name && _js_kernel_select(name))
+    fprintf(stderr, "JS_DECODE_KERNEL: no kernel %s for this CPU, using %s\n",
+            name, current->name);
+}
+
+void _js_escape_bitmap(const uint8_t *s, size_t len, uint64_t *bitmap)
+{
+  current->escape_bitmap(s, len, bitmap);
+}
+
+void _js_decoder_init(js_decoder *st)
+{
+  current->decoder_init(st);
+}
+
+int _js_decode_chunk(js_decoder *st, uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return current->decode_chunk(st, dest, destoff, s, srcend);
+}
+
+int _js_decode_finish(const js_decoder *st)
+{
+  return current->decode_finish(st);
+}
+
+int _js_decode_string(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return current->decode_string(dest, destoff, s, srcend);
+}
+
+int _js_decode_string_bounded(uint16_t *const dest, size_t *destoff,
+                  uint16_t *const destend,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return current->decode_string_bounded(dest, destoff, destend, s, srcend);
+}
+
+int _js_decode_string_bitmap(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  const uint64_t *bitmap, const uint8_t *origin)
+{
+  return current->decode_string_bitmap(dest, destoff, s, srcend,
+                                       bitmap, origin);
+}
+
+size_t _js_decoded_length(const uint8_t *s, const uint8_t *const srcend)
+{
+  return current->decoded_length(s, srcend);
+}
+
+int _js_unescape_utf8(uint8_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return current->unescape_utf8(dest, destoff, s, srcend);
+}
+
+int _js_validate_string(const uint8_t *s, const uint8_t *const srcend)
+{
+  return current->validate_string(s, srcend);
+}
+
+size_t _js_decode_batch(js_span *spans, size_t n, uint16_t *arena,
+                  uint64_t *errors)
+{
+  return current->decode_batch(spans, n, arena, errors);
+}
+
+int _js_escape_utf16(uint8_t *const dest, size_t *destoff,
+                  const uint16_t *s, const uint16_t *const srcend, int flags)
+{
+  return current->escape_utf16(dest, destoff, s, srcend, flags);
+}
+
+int _js_escape_utf8(uint8_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend, int flags)
+{
+  return current->escape_utf8(dest, destoff, s, srcend, flags);
+}
@@ -0,0 +1,227 @@
+// Coverage-guided fuzzing of the library with libFuzzer (make fuzz).
+// Every input is decoded by every kernel, which must agree with the table
+// kernel, and each kernel's other functions (bounded, length, streaming,
+// bitmap, UTF-8 output, validation, batch) must agree with its
+// _js_decode_string.
+// The parallel decoding, cut into chunks of a byte or more (MIN_CHUNK=1),
+// must agree with the table kernel too.
+// Decoded strings must also survive a round trip through the escaping.
+// The custom mutator splices escapes and UTF-8 sequences, valid or not.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unescape_string.h"
+
+#define CHECK(kernel, x) \
+  if (!(x)) { \
+    fprintf(stderr, "fuzz: kernel %s: %s\n", (kernel)->name, #x); \
+    abort(); \
+  }
+
+// UTF-16 of valid UTF-8
+static size_t utf8_to_16(uint16_t *d, const uint8_t *s, size_t n)
+{
+  size_t k = 0;
+  for (size_t i = 0; i < n;) {
+    uint32_t c = s[i];
+    int len = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : 4;
+    if (len > 1)
+      c &= 0x3f >> (len - 1);
+    for (int j = 1; j < len; j++)
+      c = c << 6 | (s[i + j] & 0x3f);
+    i += len;
+    if (c >= 0x10000) {
+      d[k++] = 0xD7C0 + (c >> 10);
+      d[k++] = 0xDC00 + (c & 0x3ff);
+    } else {
+      d[k++] = c;
+    }
+  }
+  return k;
+}
+
+static const js_kernel *table;
+static uint16_t *ref, *out;
+static uint8_t *utf8, *escaped;
+static uint64_t *bitmap;
+
+// Check kernel k on s[0..n) against the reference output of length reflen
+// (r is the reference result).
+static void check(const js_kernel *k, const uint8_t *s, size_t n,
+                  int r, size_t reflen)
+{
+  size_t ofs = 0;
+  int rk = k->decode_string(out, &ofs, s, s + n);
+  CHECK(k, rk == r);
+  CHECK(k, r || (ofs == reflen && !memcmp(out, ref, ofs * sizeof *out)));
+
+  // Bounded, with just enough room, then one unit short
+  ofs = 0;
+  rk = k->decode_string_bounded(out, &ofs, out + reflen, s, s + n);
+  CHECK(k, r ? rk != 0 : rk == 0 && ofs == reflen);
+  if (!r && reflen) {
+    ofs = 0;
+    CHECK(k, k->decode_string_bounded(out, &ofs, out + reflen - 1,
+                                      s, s + n) == -2);
+  }
+  if (!r)
+    CHECK(k, k->decoded_length(s, s + n) == reflen);
+
+  // Streaming, cut in three chunks where the input says
+  size_t cut1 = n ? s[0] % (n + 1) : 0, cut2 = n ? s[n - 1] % (n + 1) : 0;
+  if (cut1 > cut2) {
+    size_t t = cut1;
+    cut1 = cut2;
+    cut2 = t;
+  }
+  js_decoder st;
+  k->decoder_init(&st);
+  ofs = 0;
+  rk = k->decode_chunk(&st, out, &ofs, s, s + cut1);
+  if (!rk)
+    rk = k->decode_chunk(&st, out, &ofs, s + cut1, s + cut2);
+  if (!rk)
+    rk = k->decode_chunk(&st, out, &ofs, s + cut2, s + n);
+  if (!rk)
+    rk = k->decode_finish(&st);
+  CHECK(k, (rk != 0) == (r != 0));
+  CHECK(k, r || (ofs == reflen && !memcmp(out, ref, ofs * sizeof *out)));
+
+  // Escape bitmap of the string alone
+  k->escape_bitmap(s, n, bitmap);
+  ofs = 0;
+  rk = k->decode_string_bitmap(out, &ofs, s, s + n, bitmap, s);
+  CHECK(k, rk == r);
+  CHECK(k, r || (ofs == reflen && !memcmp(out, ref, ofs * sizeof *out)));
+
+  // UTF-8 output
+  ofs = 0;
+  rk = k->unescape_utf8(utf8, &ofs, s, s + n);
+  CHECK(k, (rk != 0) == (r != 0));
+  if (!r) {
+    CHECK(k, utf8_to_16(out, utf8, ofs) == reflen);
+    CHECK(k, !memcmp(out, ref, reflen * sizeof *out));
+  }
+
+  // Validation: a string without escapes is its own decoding
+  rk = k->validate_string(s, s + n);
+  int escape = memchr(s, '\\', n) != NULL;
+  CHECK(k, rk == 0 ? !escape && !r : rk == 1 ? escape : rk == -1 && r);
+  if (!rk)
+    CHECK(k, utf8_to_16(out, s, n) == reflen
+             && !memcmp(out, ref, reflen * sizeof *out));
+
+  // Batch of one
+  js_span span = { s, n, 0, 0 };
+  uint64_t errors = 0;
+  CHECK(k, k->decode_batch(&span, 1, out, &errors) == (r != 0));
+  CHECK(k, r ? span.length == 0
+             : span.length == reflen
+               && !memcmp(out + span.offset, ref, reflen * sizeof *out));
+
+  // Round trips through the escaping, decoded by the table kernel (the
+  // ascii kernel neither decodes nor escapes UTF-8)
+  if (!r) {
+    size_t utf8len = ofs;
+    int ascii = 1;
+    for (size_t i = 0; i < utf8len; i++)
+      if (utf8[i] >= 0x80)
+        ascii = 0;
+    for (int flags = 0; flags <= JS_ESCAPE_ASCII; flags++) {
+      size_t e = 0, back = 0;
+      CHECK(k, !k->escape_utf16(escaped, &e, ref, ref + reflen, flags));
+      CHECK(k, !table->decode_string(out, &back, escaped, escaped + e));
+      CHECK(k, back == reflen && !memcmp(out, ref, reflen * sizeof *out));
+      e = 0;
+      rk = k->escape_utf8(escaped, &e, utf8, utf8 + utf8len, flags);
+      if (rk && !ascii && !strcmp(k->name, "ascii"))
+        continue;
+      CHECK(k, !rk);
+      back = 0;
+      CHECK(k, !table->decode_string(out, &back, escaped, escaped + e));
+      CHECK(k, back == reflen && !memcmp(out, ref, reflen * sizeof *out));
+    }
+  }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *s, size_t n)
+{
+  // Output buffers of the exact worst-case size, for the sanitizers
+  ref = malloc((n + 1) * sizeof *ref);
+  out = malloc((n + 1) * sizeof *out);
+  utf8 = malloc(n + 1);
+  escaped = malloc(6 * n + 1);
+  bitmap = malloc((n / 64 + 1) * sizeof *bitmap);
+
+  const js_kernel *k;
+  for (size_t i = 0; (k = _js_kernel_at(i)); i++)
+    if (!strcmp(k->name, "table"))
+      table = k;
+  size_t reflen = 0;
+  int r = table->decode_string(ref, &reflen, s, s + n);
+  int ascii = 1;
+  for (size_t i = 0; i < n; i++)
+    if (s[i] >= 0x80)
+      ascii = 0;
+  for (size_t i = 0; (k = _js_kernel_at(i)); i++)
+    if (ascii || strcmp(k->name, "ascii"))
+      check(k, s, n, r, reflen);
+
+  size_t ofs = 0;
+  CHECK(table, _js_decode_string_parallel(out, &ofs, s, s + n, 4) == r);
+  // An input that ends in a sequence (1) gives what comes before it
+  CHECK(table, r < 0 ? ofs == 0
+               : ofs == reflen && !memcmp(out, ref, ofs * sizeof *out));
+
+  free(ref);
+  free(out);
+  free(utf8);
+  free(escaped);
+  free(bitmap);
+  return 0;
+}
+
+// Provided by libFuzzer: its own mutations of raw bytes
+size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size);
+
+static const char *const pieces[] = {
+  // Escapes, some of them broken
+  "\\n", "\\\"", "\\\\", "\\/", "\\t", "\\u00e9", "\\u20AC", "\\u0000",
+  "\\ud83d\\ude00", "\\uDBFF\\uDFFF", "\\ud83d", "\\ude00", "\\ud83d\\n",
+  "\\u12", "\\u12g4", "\\x", "\\",
+  // UTF-8 sequences, some of them invalid
+  "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xf4\x8f\xbf\xbf",
+  "\xed\x9f\xbf", "\xed\xa0\x80", "\xc0\xaf", "\xe0\x80\xaf", "\xe2\x82",
+  "\xf4\x90\x80\x80", "\x80", "\xff",
+};
+
+#define NPIECES (sizeof pieces / sizeof *pieces)
+
+// Splice a piece, or a long run of ASCII for the vector paths, at a random
+// place; otherwise let libFuzzer mutate.
+size_t LLVMFuzzerCustomMutator(uint8_t *data, size_t size, size_t max_size,
+                               unsigned seed)
+{
+  if (rand_r(&seed) % 4 == 0)
+    return LLVMFuzzerMutate(data, size, max_size);
+  uint8_t run[80];
+  const uint8_t *piece;
+  size_t len;
+  if (rand_r(&seed) % 8 == 0) {
+    len = 1 + rand_r(&seed) % sizeof run;
+    memset(run, 'a' + rand_r(&seed) % 26, len);
+    piece = run;
+  } else {
+    piece = (const uint8_t *) pieces[rand_r(&seed) % NPIECES];
+    len = strlen((const char *) piece);
+  }
+  size_t at = size ? rand_r(&seed) % (size + 1) : 0;
+  // Replace as many bytes as the piece, or insert it
+  size_t replaced = rand_r(&seed) % 2 ? 0 : size - at < len ? size - at : len;
+  if (size - replaced + len > max_size)
+    return LLVMFuzzerMutate(data, size, max_size);
+  memmove(data + at + len, data + at + replaced, size - at - replaced);
+  memcpy(data + at, piece, len);
+  return size - replaced + len;
+}
@@ -0,0 +1,286 @@
+// Parallel decoding of one large string: the input is cut into chunks at
+// boundaries where decoding can start afresh, the length of every chunk's
+// output is measured, and each chunk is decoded by a thread of a pool
+// straight into its slice of dest, placed by a prefix sum of the lengths.
+// Large batches of strings are split between threads too.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "unescape_string.h"
+
+// Smallest chunk worth a thread. Decoding runs at 0.6 to 2 GB/s, so 256 KB
+// take 130 to 400 us; a call costs two dispatches to the pool (1 to 3 us
+// measured, plus a wakeup of the order of 10 us on another core) and the
+// measuring pass (a third of the decoding on mixed text), which leaves a
+// chunk most of its thread's gain.
+#ifndef MIN_CHUNK
+#define MIN_CHUNK (256 << 10)
+#endif
+#define MAX_THREADS 64
+
+// Whether s[j] is a backslash that starts an escape: an odd run of
+// backslashes ends at j (the first one of a run always starts one).
+static int escape_at(const uint8_t *s, size_t j)
+{
+  size_t n = 0;
+  while (s[j] == '\\') {
+    n++;
+    if (j-- == 0)
+      break;
+  }
+  return n % 2;
+}
+
+// Whether the decoding of s can be split at s[i] (0 < i < length): s[i] is
+// neither in a UTF-8 sequence, nor in an escape, nor the low half of a
+// surrogate pair. Decoding both sides as separate strings then gives the
+// same result as decoding s whole, errors included, once an incomplete
+// UTF-8 sequence at the end of the left side (1) is counted as invalid
+// (-1): s goes on with a byte that cannot continue it. Apart from s[i] and
+// s[i + 1], only the bytes before are looked at.
+static int boundary(const uint8_t *s, size_t i)
+{
+  const uint8_t *p = s + i;
+  if ((*p & 0xc0) == 0x80) // UTF-8 continuation
+    return 0;
+  if (escape_at(s, i - 1)) // after the backslash of an escape
+    return 0;
+  for (size_t k = 2; k <= 5 && k <= i; k++) // in the digits of a \u escape
+    if (p[-k] == '\\' && p[1 - k] == 'u' && escape_at(s, i - k))
+      return 0;
+  // After \uD800 to \uDBFF (whatever the last two digits)
+  if (p[0] == '\\' && i >= 6 && p[-6] == '\\' && p[-5] == 'u'
+      && escape_at(s, i - 6) && (p[-4] | 0x20) == 'd'
+      && (p[-3] == '8' || p[-3] == '9' || (p[-3] | 0x20) == 'a'
+          || (p[-3] | 0x20) == 'b'))
+    return 0;
+  return 1;
+}
+
+typedef struct {
+  const uint8_t *s, *srcend;
+  uint16_t *dest;  // this chunk's slice
+  size_t length;   // measured output length
+  int result;
+} chunk;
+
+static void *measure(void *arg)
+{
+  chunk *c = arg;
+  c->length = _js_decoded_length(c->s, c->srcend);
+  // Valid input decodes to no more units than bytes, invalid input can
+  // measure more (or less than 0: a cut \u12): the slices must stay in
+  // dest, and the bounded decoding still finds the error first.
+  if (c->length > (size_t) (c->srcend - c->s))
+    c->length = c->srcend - c->s;
+  return NULL;
+}
+
+static void *decode(void *arg)
+{
+  chunk *c = arg;
+  // Bounded by the slice: the measure means nothing for invalid input
+  size_t ofs = 0;
+  c->result = _js_decode_string_bounded(c->dest, &ofs, c->dest + c->length,
+                                        c->s, c->srcend);
+  if (c->result == -2 || (!c->result && ofs != c->length))
+    c->result = -1;
+  // Ends in a sequence: what was decoded before it
+  if (c->result == 1)
+    c->length = ofs;
+  return NULL;
+}
+
+// Pool of worker threads, created as needed by the first calls and kept
+// for the life of the process. A job is n items of size bytes, taken one at
+// a time by the workers and by the calling thread.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static size_t workers;
+// One job at a time: other callers run theirs alone
+static pthread_mutex_t pool_user = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+  void *(*f)(void *);
+  char *items;
+  size_t size, n;
+  size_t next;     // first item not taken
+  size_t pending;  // items not done
+} job;
+
+// Take and run items of the job, pool_lock held
+static void work(void)
+{
+  while (job.next < job.n) {
+    char *item = job.items + job.next++ * job.size;
+    void *(*f)(void *) = job.f;
+    pthread_mutex_unlock(&pool_lock);
+    f(item);
+    pthread_mutex_lock(&pool_lock);
+    if (--job.pending == 0)
+      pthread_cond_signal(&pool_done);
+  }
+}
+
+static void *worker(void *arg)
+{
+  (void) arg;
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (job.next >= job.n)
+      pthread_cond_wait(&pool_work, &pool_lock);
+    work();
+  }
+  return NULL;
+}
+
+// Run f on each of the n items of size bytes, with n - 1 workers at most
+// (fewer if they cannot be created, or if the pool is busy with another
+// caller: the calling thread takes what is left).
+static void run(void *(*f)(void *), void *items, size_t size, size_t n)
+{
+  if (pthread_mutex_trylock(&pool_user)) {
+    for (size_t i = 0; i < n; i++)
+      f((char *) items + i * size);
+    return;
+  }
+  pthread_mutex_lock(&pool_lock);
+  while (workers < n - 1) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, worker, NULL))
+      break;
+    pthread_detach(tid);
+    workers++;
+  }
+  job.f = f;
+  job.items = items;
+  job.size = size;
+  job.n = n;
+  job.next = 0;
+  job.pending = n;
+  pthread_cond_broadcast(&pool_work);
+  work();
+  while (job.pending)
+    pthread_cond_wait(&pool_done, &pool_lock);
+  pthread_mutex_unlock(&pool_lock);
+  pthread_mutex_unlock(&pool_user);
+}
+
+// Same as _js_decode_string, on up to threads threads (0: one per CPU).
+// Strings too short to gain from it are decoded in the calling thread.
+int _js_decode_string_parallel(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  unsigned threads)
+{
+  size_t len = srcend - s;
+  if (!threads)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+  if (threads > len / MIN_CHUNK)
+    threads = len / MIN_CHUNK;
+  if (threads < 2)
+    return _js_decode_string(dest, destoff, s, srcend);
+
+  // Cut near every multiple of len / threads, looking backwards for a
+  // boundary; a chunk without one is merged with the next.
+  chunk chunks[MAX_THREADS];
+  size_t n = 0, start = 0;
+  for (unsigned t = 1; t < threads; t++) {
+    size_t i = len / threads * t;
+    while (i > start && !boundary(s, i))
+      i--;
+    if (i == start)
+      continue;
+    chunks[n].s = s + start;
+    chunks[n++].srcend = s + i;
+    start = i;
+  }
+  chunks[n].s = s + start;
+  chunks[n++].srcend = srcend;
+
+  run(measure, chunks, sizeof *chunks, n);
+  // Prefix sum of the lengths
+  chunks[0].dest = dest + *destoff;
+  for (size_t i = 1; i < n; i++)
+    chunks[i].dest = chunks[i - 1].dest + chunks[i - 1].length;
+  run(decode, chunks, sizeof *chunks, n);
+
+  // See boundary: only the last chunk may end in a sequence. As with
+  // _js_decode_string, *destoff is only left as is on errors (-1).
+  for (size_t i = 0; i < n - 1; i++)
+    if (chunks[i].result)
+      return -1;
+  if (chunks[n - 1].result < 0)
+    return -1;
+  *destoff = chunks[n - 1].dest + chunks[n - 1].length - dest;
+  return chunks[n - 1].result;
+}
+
+// Consecutive strings of a batch, decoded by one thread
+typedef struct {
+  js_span *spans;
+  size_t n;
+  uint16_t *arena; // room for the input length of the group
+  uint64_t *errors;
+  size_t failed;
+} group;
+
+static void *decode_group(void *arg)
+{
+  group *g = arg;
+  g->failed = _js_decode_batch(g->spans, g->n, g->arena, g->errors);
+  return NULL;
+}
+
+size_t _js_decode_batch_parallel(js_span *spans, size_t n, uint16_t *arena,
+                  uint64_t *errors, unsigned threads)
+{
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++)
+    len += spans[i].len;
+  if (!threads)
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+  if (threads > len / MIN_CHUNK)
+    threads = len / MIN_CHUNK;
+  if (threads < 2)
+    return _js_decode_batch(spans, n, arena, errors);
+
+  // Groups of whole blocks of 64 strings (each owns its words of errors)
+  // and about len / threads bytes. Each one decodes at the position of its
+  // input in the arena, then the outputs are moved together.
+  group groups[MAX_THREADS];
+  size_t ng = 0, first = 0, before = 0, bytes = 0;
+  for (size_t b = 0; b < n; b += 64) {
+    size_t end = n - b < 64 ? n : b + 64;
+    for (size_t i = b; i < end; i++)
+      bytes += spans[i].len;
+    if (end == n || (ng < threads - 1 && bytes >= len / threads * (ng + 1))) {
+      groups[ng].spans = spans + first;
+      groups[ng].n = end - first;
+      groups[ng].arena = arena + before;
+      groups[ng++].errors = errors + first / 64;
+      first = end;
+      before = bytes;
+    }
+  }
+  run(decode_group, groups, sizeof *groups, ng);
+
+  size_t failed = 0, ofs = 0;
+  for (size_t k = 0; k < ng; k++) {
+    group *g = &groups[k];
+    const js_span *last = &g->spans[g->n - 1];
+    size_t used = last->offset + last->length;
+    memmove(arena + ofs, g->arena, used * sizeof *arena);
+    for (size_t i = 0; i < g->n; i++)
+      g->spans[i].offset += ofs;
+    ofs += used;
+    failed += g->failed;
+  }
+  return failed;
+}
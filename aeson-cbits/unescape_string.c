@@ -5,14 +5,46 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#ifdef DFA_COUNTERS
+#include <stdlib.h>
+#endif
+#if !defined(THROUGHPUT) && !defined(DFA_CHECK) && !defined(KERNEL)
 #include <klee/klee.h>
+#endif
+
+#ifdef KERNEL
+// Library build: one object per kernel (see dispatch.c), whose functions
+// are prefixed with its name, e.g. avx2_js_decode_string.
+#define KERNEL_NAME(k, f) KERNEL_NAME_(k, f)
+#define KERNEL_NAME_(k, f) k##f
+#define _js_escape_bitmap KERNEL_NAME(KERNEL, _js_escape_bitmap)
+#define _js_decoder_init KERNEL_NAME(KERNEL, _js_decoder_init)
+#define _js_decode_chunk KERNEL_NAME(KERNEL, _js_decode_chunk)
+#define _js_decode_finish KERNEL_NAME(KERNEL, _js_decode_finish)
+#define _js_decode_string KERNEL_NAME(KERNEL, _js_decode_string)
+#define _js_decode_string_bounded KERNEL_NAME(KERNEL, _js_decode_string_bounded)
+#define _js_decode_string_bitmap KERNEL_NAME(KERNEL, _js_decode_string_bitmap)
+#define _js_decoded_length KERNEL_NAME(KERNEL, _js_decoded_length)
+#define _js_unescape_utf8 KERNEL_NAME(KERNEL, _js_unescape_utf8)
+#define _js_validate_string KERNEL_NAME(KERNEL, _js_validate_string)
+#define _js_decode_batch KERNEL_NAME(KERNEL, _js_decode_batch)
+#define _js_dfa_counters_flush KERNEL_NAME(KERNEL, _js_dfa_counters_flush)
+#define _js_dfa_counters KERNEL_NAME(KERNEL, _js_dfa_counters)
+#define _js_escape_utf16 KERNEL_NAME(KERNEL, _js_escape_utf16)
+#define _js_escape_utf8 KERNEL_NAME(KERNEL, _js_escape_utf8)
+#endif
+#include "unescape_string.h"
 
 
 #define UTF8_ACCEPT 0
+#ifdef SHIFT_DFA
+#define UTF8_REJECT 6
+#else
 #define UTF8_REJECT 12
+#endif
 
 #ifndef ASCII_SOURCE
-#ifndef FLOW_MACHINE
+#if !defined(FLOW_MACHINE) || defined(DFA_CHECK) || defined(DFA_COUNTERS)
 static const uint8_t utf8d[] = {
   // The first part of the table maps bytes to character classes that
   // to reduce the size of the transition table and create bitmasks.
@@ -35,8 +67,17 @@ static const uint8_t utf8d[] = {
 };
 #endif
 
-static inline uint32_t decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
-#ifdef FLOW_MACHINE
+// Three implementations of the same automaton, decode() is one of them:
+// - decode_table (default): two table loads per byte, character class then
+//   transition, with states 0, 12, ..., 96;
+// - decode_flow (FLOW_MACHINE): transitions in the control flow;
+// - decode_shift (SHIFT_DFA): the transitions on a byte for all states,
+//   packed in one 64-bit word; a state is the offset (0, 6, ..., 48) of
+//   its next state in the word, so a step is one load and one shift.
+//   Same automaton: state 12 * i of the table is state 6 * i here.
+
+#if defined(FLOW_MACHINE) || defined(DFA_CHECK)
+static inline uint32_t decode_flow(uint32_t* state, uint32_t* codep, uint32_t byte) {
   // Machine transitions are reflected in the control flow.
 
   uint32_t type;
@@ -105,7 +146,13 @@ static inline uint32_t decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
   } else {
     *state = 12;
   }
-#else
+
+  return *state;
+}
+#endif
+
+#if !defined(FLOW_MACHINE) || defined(DFA_CHECK)
+static inline uint32_t decode_table(uint32_t* state, uint32_t* codep, uint32_t byte) {
   uint32_t type = utf8d[byte];
 
 #if defined(COVERAGE) || defined(SM_COV_1)
@@ -145,12 +192,224 @@ static inline uint32_t decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
     default: break;
   }
 #endif
+
+  return *state;
+}
 #endif
 
+#if defined(SHIFT_DFA) || defined(DFA_CHECK)
+// Rows by character class (see utf8d)
+#define SR0 0x0006186186186180u
+#define SR1 0x0012486306300186u
+#define SR2 0x000618618618618cu
+#define SR3 0x0006186186186192u
+#define SR4 0x000618618618619eu
+#define SR5 0x00061861861861b0u
+#define SR6 0x00061861861861aau
+#define SR7 0x000649218c300186u
+#define SR8 0x0006186186186186u
+#define SR9 0x0006492306300186u
+#define SR10 0x0006186186186198u
+#define SR11 0x00061861861861a4u
+
+static const uint64_t utf8_shift[256] = {
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,SR0,
+  SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,SR1,
+  SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,SR9,
+  SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,
+  SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,SR7,
+  SR8,SR8,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,
+  SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,SR2,
+  SR10,SR3,SR3,SR3,SR3,SR3,SR3,SR3,SR3,SR3,SR3,SR3,SR3,SR4,SR3,SR3,
+  SR11,SR6,SR6,SR6,SR5,SR8,SR8,SR8,SR8,SR8,SR8,SR8,SR8,SR8,SR8,SR8,
+};
+
+static inline uint32_t decode_shift(uint32_t* state, uint32_t* codep, uint32_t byte) {
+  // In a lead byte, clear the leading ones (the length), like 0xff >> type
+  *codep = (*state != UTF8_ACCEPT) ?
+    (byte & 0x3fu) | (*codep << 6) :
+    (0xff >> __builtin_clz((~byte << 24) | 0x800000)) & (byte);
+
+  *state = (utf8_shift[byte] >> *state) & 63;
   return *state;
 }
 #endif
 
+#ifdef DFA_COUNTERS
+// Transition counters: the totals are per state and character class,
+// indexed like the transition table of utf8d (state + class). Every thread
+// counts on its own per state number and byte, without loading the class,
+// and _js_dfa_counters_flush adds its counts to the process totals.
+// A state is 12 (6 with SHIFT_DFA) times its number: a multiplication and
+// a shift divide it.
+#ifdef SHIFT_DFA
+#define DFA_NUMBER(state) (((state) * 43) >> 8)
+#else
+#define DFA_NUMBER(state) (((state) * 43) >> 9)
+#endif
+#define DFA_CELLS (JS_DFA_STATES * JS_DFA_CLASSES)
+
+static _Thread_local uint64_t dfa_counts[JS_DFA_STATES * 256];
+static uint64_t dfa_totals[DFA_CELLS];
+
+void _js_dfa_counters_flush(void)
+{
+  for (int i = 0; i < JS_DFA_STATES * 256; i++) {
+    if (!dfa_counts[i])
+      continue;
+    __atomic_fetch_add(&dfa_totals[i / 256 * JS_DFA_CLASSES + utf8d[i % 256]],
+                       dfa_counts[i], __ATOMIC_RELAXED);
+    dfa_counts[i] = 0;
+  }
+}
+
+void _js_dfa_counters(uint64_t counts[JS_DFA_STATES][JS_DFA_CLASSES])
+{
+  for (int i = 0; i < DFA_CELLS; i++)
+    counts[i / JS_DFA_CLASSES][i % JS_DFA_CLASSES] =
+      __atomic_load_n(&dfa_totals[i], __ATOMIC_RELAXED);
+}
+
+// At exit, add the totals (with the counts of the main thread) to the file
+// named by JS_DFA_COUNTS, so that they add up over replays or benchmark
+// runs. One line per transition: state (numbered as in utf8d), character
+// class, count.
+__attribute__((destructor)) static void dfa_counters_save(void)
+{
+  const char *name = getenv("JS_DFA_COUNTS");
+  if (!name)
+    return;
+  _js_dfa_counters_flush();
+  uint64_t counts[DFA_CELLS];
+  memcpy(counts, dfa_totals, sizeof counts);
+  FILE *f = fopen(name, "r");
+  if (f) {
+    unsigned state, class;
+    unsigned long long n;
+    char header[32];
+    int ok = fgets(header, sizeof header, f)
+      && !strcmp(header, "state\tclass\tcount\n");
+    int lines = 0;
+    while (ok && fscanf(f, "%u\t%u\t%llu\n", &state, &class, &n) == 3) {
+      ok = state + class < DFA_CELLS && state % JS_DFA_CLASSES == 0
+        && class < JS_DFA_CLASSES;
+      if (ok) {
+        counts[state + class] += n;
+        lines++;
+      }
+    }
+    ok = ok && feof(f) && lines == DFA_CELLS;
+    fclose(f);
+    // Not overwritten: its counts would be lost
+    if (!ok) {
+      fprintf(stderr, "%s: not a file of DFA counts, left as is\n", name);
+      return;
+    }
+  }
+  if (!(f = fopen(name, "w"))) {
+    perror(name);
+    return;
+  }
+  fprintf(f, "state\tclass\tcount\n");
+  for (int i = 0; i < DFA_CELLS; i++)
+    fprintf(f, "%d\t%d\t%llu\n", i - i % JS_DFA_CLASSES, i % JS_DFA_CLASSES,
+            (unsigned long long) counts[i]);
+  fclose(f);
+}
+#endif
+
+static inline uint32_t decode(uint32_t* state, uint32_t* codep, uint32_t byte) {
+#ifdef DFA_COUNTERS
+  dfa_counts[DFA_NUMBER(*state) << 8 | byte]++;
+#endif
+#if defined(FLOW_MACHINE)
+  return decode_flow(state, codep, byte);
+#elif defined(SHIFT_DFA)
+  return decode_shift(state, codep, byte);
+#else
+  return decode_table(state, codep, byte);
+#endif
+}
+
+// MULTIBYTE_DFA: from the accept state, a whole 2, 3 or 4-byte sequence in
+// one step, instead of one step of the automaton per byte (and an ASCII byte
+// without the automaton). The lead byte
+// gives the length of the sequence, its bits of the codepoint and the range
+// of the second byte (which rules out overlong forms, surrogates and
+// codepoints above U+10FFFF, as the automaton does); the other bytes are
+// continuations. Incomplete or invalid sequences are left to decode(), so
+// errors and streaming are unchanged.
+// The steps taken here would not be in the DFA_COUNTERS.
+#if defined(MULTIBYTE_DFA) && defined(DFA_COUNTERS)
+#error "DFA_COUNTERS: MULTIBYTE_DFA skips the automaton, build without it"
+#endif
+
+#if defined(MULTIBYTE_DFA) || defined(DFA_CHECK)
+static const struct {
+  uint8_t len, lo, hi;
+  uint32_t bits; // bits of the codepoint in the lead byte
+} utf8_lead[256] = {
+#define LEAD_RANGE(b, len, lo, hi) \
+  [b] = { len, lo, hi, ((b) & (0x7f >> (len))) << (6 * ((len) - 1)) }
+#define LEAD(b, len) LEAD_RANGE(b, len, 0x80, 0xbf)
+#define LEAD4(b, len) LEAD(b, len), LEAD(b + 1, len), LEAD(b + 2, len), \
+  LEAD(b + 3, len)
+  // 0xc0 and 0xc1 only start overlong forms
+  LEAD(0xc2, 2), LEAD(0xc3, 2), LEAD4(0xc4, 2), LEAD4(0xc8, 2),
+  LEAD4(0xcc, 2), LEAD4(0xd0, 2), LEAD4(0xd4, 2), LEAD4(0xd8, 2),
+  LEAD4(0xdc, 2),
+  LEAD_RANGE(0xe0, 3, 0xa0, 0xbf), // no overlong forms
+  LEAD4(0xe1, 3), LEAD4(0xe5, 3), LEAD4(0xe9, 3),
+  LEAD_RANGE(0xed, 3, 0x80, 0x9f), // no surrogates
+  LEAD(0xee, 3), LEAD(0xef, 3),
+  LEAD_RANGE(0xf0, 4, 0x90, 0xbf), // no overlong forms
+  LEAD(0xf1, 4), LEAD(0xf2, 4), LEAD(0xf3, 4),
+  LEAD_RANGE(0xf4, 4, 0x80, 0x8f), // up to U+10FFFF
+#undef LEAD4
+#undef LEAD
+#undef LEAD_RANGE
+};
+
+#define CONT(c) (((c) & 0xc0) == 0x80)
+
+// Length of the sequence at s (0: not a whole valid one), its codepoint in
+// *codep
+static inline unsigned multibyte(const uint8_t *s, const uint8_t *const srcend,
+                                 uint32_t *codep)
+{
+  unsigned len = utf8_lead[s[0]].len;
+  if (!len || (size_t) (srcend - s) < len
+      || s[1] < utf8_lead[s[0]].lo || s[1] > utf8_lead[s[0]].hi)
+    return 0;
+  uint32_t c = utf8_lead[s[0]].bits;
+  switch (len) {
+    case 2:
+      c |= s[1] & 0x3f;
+      break;
+    case 3:
+      if (!CONT(s[2]))
+        return 0;
+      c |= (s[1] & 0x3f) << 6 | (s[2] & 0x3f);
+      break;
+    default:
+      if (!CONT(s[2]) || !CONT(s[3]))
+        return 0;
+      c |= (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6 | (s[3] & 0x3f);
+  }
+  *codep = c;
+  return len;
+}
+#undef CONT
+#endif
+#endif
+
 static inline uint16_t decode_hex(uint32_t c)
 {
   if (c >= '0' && c <= '9')      return c - '0';
@@ -159,36 +418,343 @@ static inline uint16_t decode_hex(uint32_t c)
   return 0xFFFF; // Should not happen
 }
 
-// Decode, return non-zero value on error
-int _js_decode_string(uint16_t *const dest, size_t *destoff,
-                  const uint8_t *s, const uint8_t *const srcend)
+#ifdef SWAR_HEX
+// Value of the four hex digits at s, 0xFFFFFFFF if any is not one. The
+// digits are checked and converted all at once, as the bytes of a word:
+// for a byte below 0x80, b + (0x80 - lo) has its high bit set iff b >= lo,
+// and b + (0x7f - hi) iff b > hi, without carry into the next byte.
+static inline uint32_t swar_hex4(const uint8_t *s)
+{
+  const uint32_t ones = 0x01010101u, highs = 0x80808080u;
+  uint32_t w;
+  memcpy(&w, s, 4);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  w = __builtin_bswap32(w);
+#endif
+  #define IN_RANGE(x, lo, hi) \
+    (((x) + ones * (0x80 - (lo))) & ~((x) + ones * (0x7f - (hi))) & highs)
+  uint32_t digit = IN_RANGE(w, '0', '9');
+  uint32_t alpha = IN_RANGE(w | ones * 0x20, 'a', 'f'); // either case
+  #undef IN_RANGE
+  if ((w & highs) || (digit | alpha) != highs)
+    return 0xFFFFFFFF;
+  // Nibbles: '0'..'9' end in 0..9, 'a'..'f' and 'A'..'F' in 1..6
+  uint32_t v = (w & ones * 0x0f) + (alpha >> 7) * 9;
+  // First digit in the lowest byte: pair them, then swap the pairs
+  v = ((v & 0x000f000fu) << 4) | ((v >> 8) & 0x000f000fu);
+  return (v & 0xff) << 8 | v >> 16;
+}
+#endif
+
+// Vector code, unless ASCII_SWAR asks for portable code only
+#if defined(__SSE2__) && !defined(ASCII_SWAR)
+#include <immintrin.h>
+#endif
+
+// Whether n bytes can be loaded from p without crossing into the next page:
+// past the end of the input, such loads cannot fault, but AddressSanitizer
+// reports them all the same.
+#if defined(__SANITIZE_ADDRESS__)
+#define NO_OVERREAD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_OVERREAD
+#endif
+#endif
+#ifdef NO_OVERREAD
+#define PAGE_SAFE(p, n) 0
+#else
+#define PAGE_SAFE(p, n) (((uintptr_t) (p) & 4095) <= 4096 - (n))
+#endif
+
+// Flag the bytes of s[0..8) that are not plain ASCII (0x80 and above, or
+// '\\'): high bit of the byte set in the result. Bytes after the first
+// one flagged may be flagged too (borrows), which is harmless.
+static inline uint64_t swar_special(const uint8_t *s)
+{
+  const uint64_t ones = 0x0101010101010101u, highs = 0x8080808080808080u;
+  uint64_t w;
+  memcpy(&w, s, 8);
+  uint64_t x = w ^ (ones * '\\'); // zero bytes for backslashes
+  return (w | ((x - ones) & ~x)) & highs;
+}
+
+// Index of the first byte flagged in a non-zero mask
+static inline unsigned swar_first(uint64_t mask)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_ctzll(mask) / 8;
+#else
+  return __builtin_clzll(mask) / 8;
+#endif
+}
+
+#ifdef SIMD_ASCII
+// Fast path for runs of plain ASCII (below 0x80, not a backslash), which
+// need neither the DFA nor escape handling: they are widened straight into
+// the destination, ASCII_BLOCK bytes at a time.
+// ASCII_SWAR selects the portable version (e.g. for Klee, which does not
+// know vector intrinsics).
+#if defined(__AVX512BW__) && !defined(ASCII_SWAR)
+#define ASCII_BLOCK 64
+#elif defined(__AVX2__) && !defined(ASCII_SWAR)
+#define ASCII_BLOCK 32
+#elif defined(__SSE2__) && !defined(ASCII_SWAR)
+#define ASCII_BLOCK 16
+#else
+#define ASCII_BLOCK 8
+#endif
+
+// Widen the leading plain ASCII bytes of s[0..ASCII_BLOCK) into d,
+// return their number.
+static inline unsigned ascii_block(uint16_t *d, const uint8_t *s)
+{
+  unsigned n;
+#if ASCII_BLOCK == 64
+  __m512i v = _mm512_loadu_si512((const void *) s);
+  uint64_t mask = _mm512_movepi8_mask(v)
+    | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+  if (!mask) {
+    _mm512_storeu_si512((void *) d,
+        _mm512_cvtepu8_epi16(_mm512_castsi512_si256(v)));
+    _mm512_storeu_si512((void *) (d + 32),
+        _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(v, 1)));
+    return 64;
+  }
+  n = __builtin_ctzll(mask);
+#elif ASCII_BLOCK == 32
+  __m256i v = _mm256_loadu_si256((const __m256i *) s);
+  __m256i bs = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+  uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(v, bs));
+  if (!mask) {
+    _mm256_storeu_si256((__m256i *) d,
+        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+    _mm256_storeu_si256((__m256i *) (d + 16),
+        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+    return 32;
+  }
+  n = __builtin_ctz(mask);
+#elif ASCII_BLOCK == 16
+  __m128i v = _mm_loadu_si128((const __m128i *) s);
+  __m128i bs = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+  uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_or_si128(v, bs));
+  if (!mask) {
+    __m128i zero = _mm_setzero_si128();
+    _mm_storeu_si128((__m128i *) d, _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i *) (d + 8), _mm_unpackhi_epi8(v, zero));
+    return 16;
+  }
+  n = __builtin_ctz(mask);
+#else
+  uint64_t mask = swar_special(s);
+  if (!mask) {
+    for (int i = 0; i < 8; i++)
+      d[i] = s[i];
+    return 8;
+  }
+  n = swar_first(mask);
+#endif
+  for (unsigned i = 0; i < n; i++)
+    d[i] = s[i];
+  return n;
+}
+
+// Copy the leading run of plain ASCII of s to d, as long as whole blocks
+// remain; the DFA takes over at the first other byte.
+static inline void ascii_run(uint16_t **d, const uint8_t **s,
+                             const uint8_t *const srcend)
+{
+  while (srcend - *s >= ASCII_BLOCK) {
+    unsigned n = ascii_block(*d, *s);
+    *d += n;
+    *s += n;
+    if (n < ASCII_BLOCK)
+      break;
+  }
+}
+#endif
+
+// Escape bitmap: bit i (bit i % 64 of word i / 64) is set when s[i] is not
+// plain ASCII, i.e. a backslash or a byte of a UTF-8 sequence. Built once
+// for a whole document (simdjson-style), it is shared by the decoding of
+// all its strings: between two flagged bytes, the decoder copies without
+// looking at the input. bitmap needs (len + 63) / 64 words.
+void _js_escape_bitmap(const uint8_t *s, size_t len, uint64_t *bitmap)
+{
+  size_t i = 0;
+  for (; i + 64 <= len; i += 64) {
+    const uint8_t *b = s + i;
+#if defined(__AVX512BW__) && !defined(ASCII_SWAR)
+    __m512i v = _mm512_loadu_si512((const void *) b);
+    bitmap[i / 64] = _mm512_movepi8_mask(v)
+      | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+#elif defined(__AVX2__) && !defined(ASCII_SWAR)
+    const __m256i bs = _mm256_set1_epi8('\\');
+    __m256i v0 = _mm256_loadu_si256((const __m256i *) b);
+    __m256i v1 = _mm256_loadu_si256((const __m256i *) (b + 32));
+    uint64_t m0 = (uint32_t) _mm256_movemask_epi8(
+        _mm256_or_si256(v0, _mm256_cmpeq_epi8(v0, bs)));
+    uint64_t m1 = (uint32_t) _mm256_movemask_epi8(
+        _mm256_or_si256(v1, _mm256_cmpeq_epi8(v1, bs)));
+    bitmap[i / 64] = m0 | m1 << 32;
+#elif defined(__SSE2__) && !defined(ASCII_SWAR)
+    const __m128i bs = _mm_set1_epi8('\\');
+    uint64_t m = 0;
+    for (int k = 0; k < 4; k++) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (b + 16 * k));
+      m |= (uint64_t) (uint32_t) _mm_movemask_epi8(
+          _mm_or_si128(v, _mm_cmpeq_epi8(v, bs))) << (16 * k);
+    }
+    bitmap[i / 64] = m;
+#else
+    uint64_t m = 0;
+    for (int k = 0; k < 64; k++)
+      m |= (uint64_t) (b[k] >= 0x80 || b[k] == '\\') << k;
+    bitmap[i / 64] = m;
+#endif
+  }
+  if (i < len) {
+    uint64_t m = 0;
+    for (size_t k = 0; i + k < len; k++)
+      m |= (uint64_t) (s[i + k] >= 0x80 || s[i + k] == '\\') << k;
+    bitmap[i / 64] = m;
+  }
+}
+
+// Widen n bytes of ASCII into code units
+static inline void widen(uint16_t *d, const uint8_t *s, size_t n)
+{
+  size_t i = 0;
+#if defined(__SSE2__) && !defined(ASCII_SWAR)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    _mm_storeu_si128((__m128i *) (d + i), _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i *) (d + i + 8), _mm_unpackhi_epi8(v, zero));
+  }
+#endif
+  for (; i < n; i++)
+    d[i] = s[i];
+}
+
+// Byte that is not flagged in an escape bitmap
+#define PLAIN(c) ((c) < 0x80 && (c) != '\\')
+
+// Copy the input up to the next flagged byte (or end) to d. bit i of bitmap
+// stands for origin[i].
+static inline void bitmap_run(uint16_t **d, const uint8_t **s,
+                              const uint8_t *const end,
+                              const uint64_t *bitmap, const uint8_t *origin)
+{
+  size_t i = *s - origin, n = end - origin;
+  size_t w = i / 64;
+  uint64_t bits = bitmap[w] & (~(uint64_t) 0 << (i % 64));
+  while (!bits && (w + 1) * 64 < n)
+    bits = bitmap[++w];
+  size_t next = bits ? w * 64 + __builtin_ctzll(bits) : n;
+  if (next > n)
+    next = n;
+  widen(*d, *s, next - i);
+  *d += next - i;
+  *s += next - i;
+}
+
+// Position in an escape sequence, where decoding resumes with the next byte
+// (js_decoder.escape)
+enum js_escape {
+  JS_ESC_NONE,
+  JS_ESC_BACKSLASH,
+  JS_ESC_UNICODE1,
+  JS_ESC_UNICODE2,
+  JS_ESC_UNICODE3,
+  JS_ESC_UNICODE4,
+  JS_ESC_SURROGATE1,
+  JS_ESC_SURROGATE2,
+};
+
+// Decode s[0..srcend) from state st, return -1 on error, -2 if the output
+// does not fit before destend (NULL: no bound).
+// An input that ends in the middle of an escape or of a UTF-8 sequence is
+// not an error: st records where to resume.
+// With an escape bitmap of the input (bit i for origin[i]), clean spans are
+// copied without looking at them.
+static inline int js_decode(js_decoder *st, uint16_t *const dest,
+                  size_t *destoff, uint16_t *const destend,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  const uint64_t *bitmap, const uint8_t *origin)
 {
   uint16_t *d = dest + *destoff;
-  uint32_t state = 0;
-  uint32_t codepoint;
+  uint32_t state = st->state;
+  uint32_t codepoint = st->codepoint;
 
-  uint8_t surrogate = 0;
+  uint8_t surrogate = st->surrogate;
   uint16_t temp_hex = 0;
-  uint16_t unidata;
+  uint16_t unidata = st->unidata;
+
+  #define PUT(unit) {\
+    if (destend && d >= destend) {\
+      return -2;\
+    }\
+    *d++ = (uint16_t) (unit);\
+  }
 
   // Optimized version of dispatch when just an ASCII char is expected
-  #define DISPATCH_ASCII(label) {\
+  #define DISPATCH_ASCII(label, esc) {\
     if (s >= srcend) {\
-      return -1;\
+      st->escape = esc;\
+      goto suspend;\
     }\
     codepoint = *s++;\
     goto label;\
   }
 
+  switch (st->escape) {
+    case JS_ESC_BACKSLASH:  DISPATCH_ASCII(backslash, JS_ESC_BACKSLASH)
+    case JS_ESC_UNICODE1:   DISPATCH_ASCII(unicode1, JS_ESC_UNICODE1)
+    case JS_ESC_UNICODE2:   DISPATCH_ASCII(unicode2, JS_ESC_UNICODE2)
+    case JS_ESC_UNICODE3:   DISPATCH_ASCII(unicode3, JS_ESC_UNICODE3)
+    case JS_ESC_UNICODE4:   DISPATCH_ASCII(unicode4, JS_ESC_UNICODE4)
+    case JS_ESC_SURROGATE1: DISPATCH_ASCII(surrogate1, JS_ESC_SURROGATE1)
+    case JS_ESC_SURROGATE2: DISPATCH_ASCII(surrogate2, JS_ESC_SURROGATE2)
+    default: break;
+  }
+
   standard:
     // Test end of stream
     while (s < srcend) {
+        if (state == UTF8_ACCEPT) {
+          // ASCII runs write one unit per byte
+          const uint8_t *runend = srcend;
+          if (destend && destend - d < srcend - s)
+            runend = s + (destend - d);
+          // Spans of less than two bytes (escape-dense input) are not
+          // worth a look at the bitmap
+          if (bitmap) {
+            if (s + 2 <= runend && PLAIN(s[0]) && PLAIN(s[1]))
+              bitmap_run(&d, &s, runend, bitmap, origin);
+          }
+#ifdef SIMD_ASCII
+          else
+            ascii_run(&d, &s, runend);
+#endif
+          if (s >= srcend)
+            break;
+        }
 #ifdef ASCII_SOURCE
         // Assume s is ASCII
         // state remains constant = UTF8_ACCEPT
         codepoint = (uint8_t) *s++;
         if (codepoint >= 0x80) { return -1; }
 #else
+#ifdef MULTIBYTE_DFA
+        unsigned len;
+        if (state == UTF8_ACCEPT && *s < 0x80)
+          codepoint = *s++;
+        else if (state == UTF8_ACCEPT
+                 && (len = multibyte(s, srcend, &codepoint)))
+          s += len;
+        else
+#endif
         if (decode(&state, &codepoint, *s++) != UTF8_ACCEPT) {
           if (state == UTF8_REJECT) { return -1; }
           continue;
@@ -196,64 +762,95 @@ int _js_decode_string(uint16_t *const dest, size_t *destoff,
 #endif
 
         if (codepoint == '\\')
-          DISPATCH_ASCII(backslash)
+          DISPATCH_ASCII(backslash, JS_ESC_BACKSLASH)
         else if (codepoint <= 0xffff) {
-          *d++ = (uint16_t) codepoint;
+          PUT(codepoint);
         } else {
-          *d++ = (uint16_t) (0xD7C0 + (codepoint >> 10));
-          *d++ = (uint16_t) (0xDC00 + (codepoint & 0x3FF));
+          PUT(0xD7C0 + (codepoint >> 10));
+          PUT(0xDC00 + (codepoint & 0x3FF));
         }
     }
-    *destoff = d - dest;
+    st->escape = JS_ESC_NONE;
+  suspend:
     // Exit point
-    return (state != UTF8_ACCEPT);
+    st->state = state;
+    st->codepoint = codepoint;
+    st->surrogate = surrogate;
+    st->unidata = unidata;
+    *destoff = d - dest;
+    return 0;
   backslash:
     switch (codepoint) {
       case '"':
       case '\\':
       case '/':
-        *d++ = (uint16_t) codepoint;
+        PUT(codepoint);
         goto standard;
       case 'b':
-        *d++ = '\b';
+        PUT('\b');
         goto standard;
       case 'f':
-        *d++ = '\f';
+        PUT('\f');
         goto standard;
       case 'n':
-        *d++ = '\n';
+        PUT('\n');
         goto standard;
       case 'r':
-        *d++ = '\r';
+        PUT('\r');
         goto standard;
       case 't':
-        *d++ = '\t';
+        PUT('\t');
         goto standard;
       case 'u':
-        DISPATCH_ASCII(unicode1);
+        goto unicode;
       default:
         return -1;
     }
+  unicode:
+#ifdef SWAR_HEX
+    // All four digits at once, a surrogate pair as one 12-byte unit
+    if (srcend - s >= 4) {
+      uint32_t u = swar_hex4(s);
+      if (u == 0xFFFFFFFF) { return -1; }
+      s += 4;
+      unidata = u;
+      if (!surrogate && unidata >= 0xD800 && unidata <= 0xDBFF
+          && srcend - s >= 6 && s[0] == '\\' && s[1] == 'u') {
+        u = swar_hex4(s + 2);
+        if (u >= 0xDC00 && u <= 0xDFFF) {
+          PUT(unidata);
+          PUT(u);
+          s += 6;
+          goto standard;
+        }
+      }
+      goto unicode_done;
+    }
+#endif
+    DISPATCH_ASCII(unicode1, JS_ESC_UNICODE1);
   unicode1:
     temp_hex = decode_hex(codepoint);
     if (temp_hex == 0xFFFF) { return -1; }
     else unidata = temp_hex << 12;
-    DISPATCH_ASCII(unicode2);
+    DISPATCH_ASCII(unicode2, JS_ESC_UNICODE2);
   unicode2:
     temp_hex = decode_hex(codepoint);
     if (temp_hex == 0xFFFF) { return -1; }
     else unidata |= temp_hex << 8;
-    DISPATCH_ASCII(unicode3);
+    DISPATCH_ASCII(unicode3, JS_ESC_UNICODE3);
   unicode3:
     temp_hex = decode_hex(codepoint);
     if (temp_hex == 0xFFFF) { return -1; }
     else unidata |= temp_hex << 4;
-    DISPATCH_ASCII(unicode4);
+    DISPATCH_ASCII(unicode4, JS_ESC_UNICODE4);
   unicode4:
     temp_hex = decode_hex(codepoint);
     if (temp_hex == 0xFFFF) { return -1; }
     else unidata |= temp_hex;
-    *d++ = (uint16_t) unidata;
+#ifdef SWAR_HEX
+  unicode_done:
+#endif
+    PUT(unidata);
 
     if (surrogate) {
       if (unidata < 0xDC00 || unidata > 0xDFFF) // is not low surrogate
@@ -261,20 +858,1048 @@ int _js_decode_string(uint16_t *const dest, size_t *destoff,
       surrogate = 0;
     } else if (unidata >= 0xD800 && unidata <= 0xDBFF ) { // is high surrogate
         surrogate = 1;
-        DISPATCH_ASCII(surrogate1);
+        DISPATCH_ASCII(surrogate1, JS_ESC_SURROGATE1);
     } else if (unidata >= 0xDC00 && unidata <= 0xDFFF) { // is low surrogate
         return -1;
     }
     goto standard;
   surrogate1:
     if (codepoint != '\\') { return -1; }
-    DISPATCH_ASCII(surrogate2)
+    DISPATCH_ASCII(surrogate2, JS_ESC_SURROGATE2)
   surrogate2:
     if (codepoint != 'u') { return -1; }
-    DISPATCH_ASCII(unicode1)
+    goto unicode;
+  #undef DISPATCH_ASCII
+  #undef PUT
+}
+
+void _js_decoder_init(js_decoder *st)
+{
+  st->state = UTF8_ACCEPT;
+  st->codepoint = 0;
+  st->unidata = 0;
+  st->surrogate = 0;
+  st->escape = JS_ESC_NONE;
+}
+
+// Decode the next chunk of a string, return -1 on error (after which st
+// must not be reused). dest needs room for srcend - s + 1 code units: one
+// more than the chunk, for a surrogate pair completed by its first byte.
+int _js_decode_chunk(js_decoder *st, uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return js_decode(st, dest, destoff, NULL, s, srcend, NULL, NULL);
+}
+
+// End of the string: -1 if it ends in the middle of an escape, 1 in the
+// middle of a UTF-8 sequence, 0 if complete.
+int _js_decode_finish(const js_decoder *st)
+{
+  if (st->escape != JS_ESC_NONE)
+    return -1;
+  return (st->state != UTF8_ACCEPT);
+}
+
+static inline int js_decode_string(uint16_t *const dest, size_t *destoff,
+                  uint16_t *const destend,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  const uint64_t *bitmap, const uint8_t *origin)
+{
+  js_decoder st;
+  size_t ofs = *destoff;
+  _js_decoder_init(&st);
+  int r = js_decode(&st, dest, &ofs, destend, s, srcend, bitmap, origin);
+  if (r)
+    return r;
+  if (st.escape != JS_ESC_NONE)
+    return -1;
+  *destoff = ofs;
+  return (st.state != UTF8_ACCEPT);
+}
+
+// Decode, return non-zero value on error
+int _js_decode_string(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return js_decode_string(dest, destoff, NULL, s, srcend, NULL, NULL);
+}
+
+// Same, writing nothing at or after destend: return -2 if the output does
+// not fit (the part that fits has been written, *destoff is unchanged).
+int _js_decode_string_bounded(uint16_t *const dest, size_t *destoff,
+                  uint16_t *const destend,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  return js_decode_string(dest, destoff, destend, s, srcend, NULL, NULL);
+}
+
+// Same as _js_decode_string, with the escape bitmap of a document that
+// contains s[0..srcend), starting at origin (see _js_escape_bitmap).
+// Strings where more than one byte in four is flagged are decoded without
+// it: spans are too short to pay for the lookups.
+int _js_decode_string_bitmap(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  const uint64_t *bitmap, const uint8_t *origin)
+{
+  size_t flagged = 0;
+  for (size_t w = (s - origin) / 64; w * 64 < (size_t) (srcend - origin); w++)
+    flagged += __builtin_popcountll(bitmap[w]);
+  if (flagged * 4 > (size_t) (srcend - s))
+    bitmap = NULL;
+  return js_decode_string(dest, destoff, NULL, s, srcend, bitmap, origin);
+}
+
+// Whether s[0..len) is plain ASCII (no backslash), which decodes to itself
+static inline int plain_span(const uint8_t *s, size_t len)
+{
+  size_t i = 0;
+#if defined(__SSE2__) && !defined(ASCII_SWAR)
+  const __m128i bs = _mm_set1_epi8('\\');
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, bs))))
+      return 0;
+  }
+  // The tail in one load, unless the 16 bytes cross into the next page
+  // (the bytes after the end are then on the same page, and ignored).
+  if (i < len && PAGE_SAFE(s + i, 16)) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    uint32_t mask = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, bs)));
+    return !(mask & ((1u << (len - i)) - 1));
+  }
+#else
+  for (; i + 8 <= len; i += 8)
+    if (swar_special(s + i))
+      return 0;
+#endif
+  for (; i < len; i++)
+    if (!PLAIN(s[i]))
+      return 0;
+  return 1;
+}
+
+// Strings up to this length are classified by plain_span first
+#define BATCH_SHORT 64
+
+// Decode the n strings of spans one after the other into arena, which needs
+// room for the sum of their lengths. For every string, set its offset and
+// length in arena, and its bit in errors ((n + 63) / 64 words) if it does
+// not decode (its length is then 0). Return the number of such strings.
+// Every 64 strings, a first pass picks the short ones that are plain ASCII:
+// they are widened without decoding.
+size_t _js_decode_batch(js_span *spans, size_t n, uint16_t *arena,
+                  uint64_t *errors)
+{
+  size_t ofs = 0, failed = 0, rest = 0;
+  for (size_t i = 0; i < n; i++)
+    rest += spans[i].len;
+  for (size_t b = 0; b < n; b += 64) {
+    size_t m = n - b < 64 ? n - b : 64;
+    uint64_t plain = 0, err = 0;
+    for (size_t i = 0; i < m; i++) {
+      const js_span *sp = &spans[b + i];
+      plain |= (uint64_t) (sp->len <= BATCH_SHORT
+                           && plain_span(sp->s, sp->len)) << i;
+    }
+    for (size_t i = 0; i < m; i++) {
+      js_span *sp = &spans[b + i];
+      sp->offset = ofs;
+      if (plain >> i & 1) {
+#if defined(__SSE2__) && !defined(ASCII_SWAR)
+        // Whole blocks of 16 while the arena has room for them (the output
+        // so far is no longer than the input): they may spill into the
+        // next strings' place, which is written afterwards.
+        if (sp->len <= 32 && rest - sp->len >= 32 && PAGE_SAFE(sp->s, 32)) {
+          const __m128i zero = _mm_setzero_si128();
+          for (size_t j = 0; j < sp->len; j += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (sp->s + j));
+            _mm_storeu_si128((__m128i *) (arena + ofs + j),
+                             _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i *) (arena + ofs + j + 8),
+                             _mm_unpackhi_epi8(v, zero));
+          }
+        } else
+#endif
+        widen(arena + ofs, sp->s, sp->len);
+        ofs += sp->len;
+      } else if (js_decode_string(arena, &ofs, NULL, sp->s, sp->s + sp->len,
+                                  NULL, NULL)) {
+        // Its partial output is dropped
+        ofs = sp->offset;
+        err |= (uint64_t) 1 << i;
+        failed++;
+      }
+      sp->length = ofs - sp->offset;
+      rest -= sp->len;
+    }
+    errors[b / 64] = err;
+  }
+  return failed;
+}
+
+// Number of UTF-16 code units that s[0..srcend) decodes to, exact for
+// strings that decode without error (for others it means nothing).
+// Every byte but UTF-8 continuations gives one unit, 4-byte sequences
+// two (a surrogate pair). Escapes give fewer units than bytes: \X one
+// for two, \uXXXX one for six. Bytes are counted in blocks of fixed size,
+// which the compiler vectorises; only the blocks with a backslash are
+// scanned for escapes.
+#define LENGTH_BLOCK 64
+
+// Subtract the extra bytes of the escapes starting in [p, end), from
+// *next on (escapes may run over the end of a block).
+static inline size_t escapes_in(const uint8_t *p, const uint8_t *end,
+                                const uint8_t **next, const uint8_t *srcend)
+{
+  size_t extra = 0;
+  if (p < *next)
+    p = *next;
+  while (p < end && (p = memchr(p, '\\', end - p)) != NULL) {
+    if (p + 1 < srcend && p[1] == 'u') {
+      extra += 5;
+      p += 6;
+    } else {
+      extra += 1;
+      p += 2;
+    }
+  }
+  if (p && p > *next)
+    *next = p;
+  return extra;
+}
+
+size_t _js_decoded_length(const uint8_t *s, const uint8_t *const srcend)
+{
+  size_t units = 0;
+  const uint8_t *p = s, *next = s;
+  while (srcend - p >= LENGTH_BLOCK) {
+    unsigned n = 0, backslash = 0;
+    for (int i = 0; i < LENGTH_BLOCK; i++) {
+      n += ((p[i] & 0xc0) != 0x80) + (p[i] >= 0xf0);
+      backslash |= p[i] == '\\';
+    }
+    units += n;
+    if (backslash)
+      units -= escapes_in(p, p + LENGTH_BLOCK, &next, srcend);
+    p += LENGTH_BLOCK;
+  }
+  for (const uint8_t *q = p; q < srcend; q++)
+    units += ((*q & 0xc0) != 0x80) + (*q >= 0xf0);
+  return units - escapes_in(p, srcend, &next, srcend);
+}
+
+// Validation without decoding, for strings that need none. Runs of plain
+// ASCII are skipped a block at a time (ASCII_BLOCK with SIMD_ASCII, else 8
+// bytes), other characters go through the automaton (or multibyte()).
+#ifdef SIMD_ASCII
+#define PLAIN_BLOCK ASCII_BLOCK
+#else
+#define PLAIN_BLOCK 8
+#endif
+
+// Number of plain bytes at the start of the PLAIN_BLOCK bytes at s
+static inline unsigned plain_block(const uint8_t *s)
+{
+#if PLAIN_BLOCK == 64
+  __m512i v = _mm512_loadu_si512((const void *) s);
+  uint64_t mask = _mm512_movepi8_mask(v)
+    | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+  return mask ? __builtin_ctzll(mask) : 64;
+#elif PLAIN_BLOCK == 32
+  __m256i v = _mm256_loadu_si256((const __m256i *) s);
+  __m256i bs = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+  uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(v, bs));
+  return mask ? __builtin_ctz(mask) : 32;
+#elif PLAIN_BLOCK == 16
+  __m128i v = _mm_loadu_si128((const __m128i *) s);
+  __m128i bs = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+  uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_or_si128(v, bs));
+  return mask ? __builtin_ctz(mask) : 16;
+#else
+  uint64_t mask = swar_special(s);
+  return mask ? swar_first(mask) : 8;
+#endif
+}
+
+// Whether s needs decoding at all: 0 if it is valid UTF-8 without escapes,
+// its decoding being then its own text (a view of s can stand for the output
+// of _js_unescape_utf8, or be transcoded as it is), 1 if it has an escape and
+// must be decoded (nothing after the first backslash is checked), -1 if it is
+// invalid before any escape (_js_decode_string fails too).
+int _js_validate_string(const uint8_t *s, const uint8_t *const srcend)
+{
+  while (s < srcend) {
+    while (srcend - s >= PLAIN_BLOCK) {
+      unsigned n = plain_block(s);
+      s += n;
+      if (n < PLAIN_BLOCK)
+        break;
+    }
+    // The tail in one block too, unless it crosses into the next page
+    if (s < srcend && PAGE_SAFE(s, PLAIN_BLOCK)) {
+      unsigned n = plain_block(s);
+      s = n < (size_t) (srcend - s) ? s + n : srcend;
+    }
+    while (s < srcend && PLAIN(*s))
+      s++;
+    if (s == srcend)
+      break;
+    if (*s == '\\')
+      return 1;
+#ifdef ASCII_SOURCE
+    return -1;
+#else
+    // One UTF-8 sequence
+    uint32_t state = UTF8_ACCEPT, codepoint;
+#ifdef MULTIBYTE_DFA
+    unsigned len = multibyte(s, srcend, &codepoint);
+    if (len) {
+      s += len;
+      continue;
+    }
+#endif
+    do {
+      if (decode(&state, &codepoint, *s++) == UTF8_REJECT)
+        return -1;
+    } while (state != UTF8_ACCEPT && s < srcend);
+    if (state != UTF8_ACCEPT)
+      return -1;
+#endif
+  }
+  return 0;
+}
+
+// UTF-8 encoding of c at d (c < 0x110000, not a surrogate), return the
+// position after it.
+static inline uint8_t *put_utf8(uint8_t *d, uint32_t c)
+{
+  if (c < 0x80) {
+    *d++ = c;
+  } else if (c < 0x800) {
+    *d++ = 0xc0 | (c >> 6);
+    *d++ = 0x80 | (c & 0x3f);
+  } else if (c < 0x10000) {
+    *d++ = 0xe0 | (c >> 12);
+    *d++ = 0x80 | ((c >> 6) & 0x3f);
+    *d++ = 0x80 | (c & 0x3f);
+  } else {
+    *d++ = 0xf0 | (c >> 18);
+    *d++ = 0x80 | ((c >> 12) & 0x3f);
+    *d++ = 0x80 | ((c >> 6) & 0x3f);
+    *d++ = 0x80 | (c & 0x3f);
+  }
+  return d;
+}
+
+// Four hex digits at *s, 0xFFFFFFFF if invalid or missing.
+static inline uint32_t hex4(const uint8_t **s, const uint8_t *const srcend)
+{
+  if (srcend - *s < 4)
+    return 0xFFFFFFFF;
+#ifdef SWAR_HEX
+  *s += 4;
+  return swar_hex4(*s - 4);
+#else
+  uint32_t u = 0;
+  for (int i = 0; i < 4; i++) {
+    uint16_t h = decode_hex(*(*s)++);
+    if (h == 0xFFFF)
+      return 0xFFFFFFFF;
+    u = u << 4 | h;
+  }
+  return u;
+#endif
+}
+
+// Unescape to UTF-8, return non-zero value on error, like _js_decode_string.
+// Runs without escapes are validated by the DFA and moved in bulk; \uXXXX
+// escapes are encoded, surrogate pairs as one 4-byte sequence. The output
+// is never longer than the input, and is written behind the input: dest may
+// be s (in place).
+int _js_unescape_utf8(uint8_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend)
+{
+  uint8_t *d = dest + *destoff;
+  uint32_t state = UTF8_ACCEPT;
+#ifndef ASCII_SOURCE
+  uint32_t codepoint;
+#endif
+
+  while (s < srcend) {
+    // Run up to the next escape; complete marks the end of the last whole
+    // codepoint, in case the input stops in the middle of one.
+    const uint8_t *run = s, *complete = s;
+    while (s < srcend) {
+      uint8_t c = *s;
+      if (c < 0x80 && state == UTF8_ACCEPT) {
+        if (c == '\\')
+          break;
+        // Skip plain ASCII 8 bytes at a time
+        s++;
+        while (srcend - s >= 8) {
+          uint64_t mask = swar_special(s);
+          if (mask) {
+            s += swar_first(mask);
+            break;
+          }
+          s += 8;
+        }
+        complete = s;
+        continue;
+      }
+#ifdef ASCII_SOURCE
+      return -1;
+#else
+#ifdef MULTIBYTE_DFA
+      unsigned len;
+      if (state == UTF8_ACCEPT && (len = multibyte(s, srcend, &codepoint))) {
+        s += len;
+        complete = s;
+        continue;
+      }
+#endif
+      s++;
+      if (decode(&state, &codepoint, c) == UTF8_ACCEPT)
+        complete = s;
+      else if (state == UTF8_REJECT)
+        return -1;
+#endif
+    }
+    memmove(d, run, complete - run);
+    d += complete - run;
+    if (s == srcend)
+      break;
+
+    // Escape
+    if (++s >= srcend)
+      return -1;
+    uint32_t u;
+    switch (*s++) {
+      case '"':
+      case '\\':
+      case '/':
+        *d++ = s[-1];
+        break;
+      case 'b':
+        *d++ = '\b';
+        break;
+      case 'f':
+        *d++ = '\f';
+        break;
+      case 'n':
+        *d++ = '\n';
+        break;
+      case 'r':
+        *d++ = '\r';
+        break;
+      case 't':
+        *d++ = '\t';
+        break;
+      case 'u':
+        u = hex4(&s, srcend);
+        if (u == 0xFFFFFFFF || (u >= 0xDC00 && u <= 0xDFFF)) // is low surrogate
+          return -1;
+        if (u >= 0xD800 && u <= 0xDBFF) { // is high surrogate
+          if (srcend - s < 2 || s[0] != '\\' || s[1] != 'u')
+            return -1;
+          s += 2;
+          uint32_t low = hex4(&s, srcend);
+          if (low == 0xFFFFFFFF || low < 0xDC00 || low > 0xDFFF)
+            return -1;
+          u = 0x10000 + ((u - 0xD800) << 10) + (low - 0xDC00);
+        }
+        d = put_utf8(d, u);
+        break;
+      default:
+        return -1;
+    }
+  }
+  *destoff = d - dest;
+  return (state != UTF8_ACCEPT);
 }
 
+// Escaping, the inverse of the decoding: from UTF-16 or UTF-8 to the
+// contents of a JSON string (without the quotes). '"', '\\' and control
+// characters are escaped (\b, \f, \n, \r, \t or \u00XX), and with
+// JS_ESCAPE_ASCII every other non-ASCII character too (\uXXXX, a surrogate
+// pair above U+FFFF). dest needs room for 6 bytes per input unit.
+
+// Byte or code unit that is copied as is
+#define CLEAN(c) ((c) >= 0x20 && (c) < 0x80 && (c) != '"' && (c) != '\\')
+
+// Flag the bytes of s[0..8) that are not CLEAN, like swar_special
+static inline uint64_t swar_escaped(const uint8_t *s)
+{
+  const uint64_t ones = 0x0101010101010101u, highs = 0x8080808080808080u;
+  uint64_t w;
+  memcpy(&w, s, 8);
+  uint64_t x = w ^ (ones * '\\'), y = w ^ (ones * '"');
+  return (w | ((x - ones) & ~x) | ((y - ones) & ~y) | ((w - ones * 0x20) & ~w))
+    & highs;
+}
+
+#if defined(__AVX512BW__) && !defined(ASCII_SWAR)
+#define ESCAPE_BLOCK 64
+#elif defined(__AVX2__) && !defined(ASCII_SWAR)
+#define ESCAPE_BLOCK 32
+#elif defined(__SSE2__) && !defined(ASCII_SWAR)
+#define ESCAPE_BLOCK 16
+#else
+#define ESCAPE_BLOCK 8
+#endif
+
+// Copy s[0..ESCAPE_BLOCK) to d, return the number of leading CLEAN bytes
+static inline unsigned clean_block(uint8_t *d, const uint8_t *s)
+{
+#if ESCAPE_BLOCK == 64
+  __m512i v = _mm512_loadu_si512((const void *) s);
+  _mm512_storeu_si512((void *) d, v);
+  uint64_t mask = _mm512_movepi8_mask(v)
+    | _mm512_cmplt_epu8_mask(v, _mm512_set1_epi8(0x20))
+    | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"'))
+    | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'));
+  return mask ? __builtin_ctzll(mask) : 64;
+#elif ESCAPE_BLOCK == 32
+  __m256i v = _mm256_loadu_si256((const __m256i *) s);
+  _mm256_storeu_si256((__m256i *) d, v);
+  __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v);
+  __m256i q = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+  __m256i bs = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+  uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_or_si256(v, ctl), _mm256_or_si256(q, bs)));
+  return mask ? __builtin_ctz(mask) : 32;
+#elif ESCAPE_BLOCK == 16
+  __m128i v = _mm_loadu_si128((const __m128i *) s);
+  _mm_storeu_si128((__m128i *) d, v);
+  __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v);
+  __m128i q = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+  __m128i bs = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+  uint32_t mask = (uint32_t) _mm_movemask_epi8(
+      _mm_or_si128(_mm_or_si128(v, ctl), _mm_or_si128(q, bs)));
+  return mask ? __builtin_ctz(mask) : 16;
+#else
+  memcpy(d, s, 8);
+  uint64_t mask = swar_escaped(s);
+  return mask ? swar_first(mask) : 8;
+#endif
+}
+
+#if defined(__AVX2__) && !defined(ASCII_SWAR)
+#define ESCAPE_BLOCK16 32
+#elif defined(__SSE2__) && !defined(ASCII_SWAR)
+#define ESCAPE_BLOCK16 16
+#endif
+
+#ifdef ESCAPE_BLOCK16
+// Narrow s[0..ESCAPE_BLOCK16) into d, return the number of leading CLEAN
+// code units
+static inline unsigned clean_block16(uint8_t *d, const uint16_t *s)
+{
+#if ESCAPE_BLOCK16 == 32
+  const __m256i lo = _mm256_set1_epi16(0x1f), hi = _mm256_set1_epi16(0x80);
+  const __m256i q = _mm256_set1_epi16('"'), bs = _mm256_set1_epi16('\\');
+  __m256i v0 = _mm256_loadu_si256((const __m256i *) s);
+  __m256i v1 = _mm256_loadu_si256((const __m256i *) (s + 16));
+  // Signed comparisons: units from 0x8000 are below 0x20 too
+  __m256i ok0 = _mm256_and_si256(_mm256_cmpgt_epi16(v0, lo),
+                                 _mm256_cmpgt_epi16(hi, v0));
+  __m256i ok1 = _mm256_and_si256(_mm256_cmpgt_epi16(v1, lo),
+                                 _mm256_cmpgt_epi16(hi, v1));
+  __m256i no0 = _mm256_or_si256(_mm256_cmpeq_epi16(v0, q),
+                                _mm256_cmpeq_epi16(v0, bs));
+  __m256i no1 = _mm256_or_si256(_mm256_cmpeq_epi16(v1, q),
+                                _mm256_cmpeq_epi16(v1, bs));
+  // packs works within 128-bit lanes: put the quarters back in order
+  __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(v0, v1), 0xd8);
+  __m256i clean = _mm256_permute4x64_epi64(_mm256_packs_epi16(
+      _mm256_andnot_si256(no0, ok0), _mm256_andnot_si256(no1, ok1)), 0xd8);
+  _mm256_storeu_si256((__m256i *) d, bytes);
+  uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(clean);
+  return mask ? __builtin_ctz(mask) : 32;
+#else
+  const __m128i lo = _mm_set1_epi16(0x1f), hi = _mm_set1_epi16(0x80);
+  const __m128i q = _mm_set1_epi16('"'), bs = _mm_set1_epi16('\\');
+  __m128i v0 = _mm_loadu_si128((const __m128i *) s);
+  __m128i v1 = _mm_loadu_si128((const __m128i *) (s + 8));
+  // Signed comparisons: units from 0x8000 are below 0x20 too
+  __m128i ok0 = _mm_and_si128(_mm_cmpgt_epi16(v0, lo), _mm_cmplt_epi16(v0, hi));
+  __m128i ok1 = _mm_and_si128(_mm_cmpgt_epi16(v1, lo), _mm_cmplt_epi16(v1, hi));
+  __m128i no0 = _mm_or_si128(_mm_cmpeq_epi16(v0, q), _mm_cmpeq_epi16(v0, bs));
+  __m128i no1 = _mm_or_si128(_mm_cmpeq_epi16(v1, q), _mm_cmpeq_epi16(v1, bs));
+  __m128i clean = _mm_packs_epi16(_mm_andnot_si128(no0, ok0),
+                                  _mm_andnot_si128(no1, ok1));
+  _mm_storeu_si128((__m128i *) d, _mm_packus_epi16(v0, v1));
+  uint32_t mask = ~(uint32_t) _mm_movemask_epi8(clean) & 0xffff;
+  return mask ? __builtin_ctz(mask) : 16;
+#endif
+}
+#endif
+
+// \uXXXX escape of u < 0x10000
+static inline uint8_t *put_u(uint8_t *d, uint32_t u)
+{
+  static const char digits[] = "0123456789abcdef";
+  d[0] = '\\';
+  d[1] = 'u';
+  d[2] = digits[u >> 12];
+  d[3] = digits[(u >> 8) & 0xf];
+  d[4] = digits[(u >> 4) & 0xf];
+  d[5] = digits[u & 0xf];
+  return d + 6;
+}
+
+// Escape of c: ASCII but not CLEAN, or any codepoint not a surrogate
+static inline uint8_t *put_escape(uint8_t *d, uint32_t c)
+{
+  uint8_t e;
+  switch (c) {
+    case '"':  e = '"'; break;
+    case '\\': e = '\\'; break;
+    case '\b': e = 'b'; break;
+    case '\f': e = 'f'; break;
+    case '\n': e = 'n'; break;
+    case '\r': e = 'r'; break;
+    case '\t': e = 't'; break;
+    default:
+      if (c < 0x10000)
+        return put_u(d, c);
+      c -= 0x10000;
+      return put_u(put_u(d, 0xD800 + (c >> 10)), 0xDC00 + (c & 0x3ff));
+  }
+  d[0] = '\\';
+  d[1] = e;
+  return d + 2;
+}
+
+// Escape UTF-16 to UTF-8, return -1 on unpaired surrogates.
+int _js_escape_utf16(uint8_t *const dest, size_t *destoff,
+                  const uint16_t *s, const uint16_t *const srcend, int flags)
+{
+  uint8_t *d = dest + *destoff;
+
+  while (s < srcend) {
+#ifdef ESCAPE_BLOCK16
+    // Runs of clean units are narrowed a block at a time, when they are
+    // not too short to gain from it
+    while (srcend - s >= ESCAPE_BLOCK16 && CLEAN(s[0]) && CLEAN(s[1])) {
+      unsigned n = clean_block16(d, s);
+      d += n;
+      s += n;
+      if (n < ESCAPE_BLOCK16)
+        break;
+    }
+    if (s == srcend)
+      break;
+#endif
+    uint32_t c = *s++;
+    if (CLEAN(c)) {
+      *d++ = c;
+      continue;
+    }
+    if (c >= 0xD800 && c <= 0xDFFF) {
+      if (c >= 0xDC00 || s == srcend || *s < 0xDC00 || *s > 0xDFFF)
+        return -1;
+      c = 0x10000 + ((c - 0xD800) << 10) + (*s++ - 0xDC00);
+    }
+    if (c < 0x80 || (flags & JS_ESCAPE_ASCII))
+      d = put_escape(d, c);
+    else
+      d = put_utf8(d, c);
+  }
+  *destoff = d - dest;
+  return 0;
+}
+
+// Escape UTF-8, return -1 if it is not valid. Runs of clean bytes are copied
+// a block at a time, runs of UTF-8 sequences validated by the DFA and copied
+// in one go (or escaped one by one with JS_ESCAPE_ASCII).
+int _js_escape_utf8(uint8_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend, int flags)
+{
+  uint8_t *d = dest + *destoff;
+
+  while (s < srcend) {
+    while (srcend - s >= ESCAPE_BLOCK && CLEAN(s[0]) && CLEAN(s[1])) {
+      unsigned n = clean_block(d, s);
+      d += n;
+      s += n;
+      if (n < ESCAPE_BLOCK)
+        break;
+    }
+    if (s == srcend)
+      break;
+    if (*s < 0x80) {
+      if (CLEAN(*s))
+        *d++ = *s;
+      else
+        d = put_escape(d, *s);
+      s++;
+      continue;
+    }
+#ifdef ASCII_SOURCE
+    return -1;
+#else
+    const uint8_t *run = s;
+    uint32_t state = UTF8_ACCEPT, codepoint;
+    do {
+#ifdef MULTIBYTE_DFA
+      unsigned len;
+      if (state == UTF8_ACCEPT && (len = multibyte(s, srcend, &codepoint))) {
+        s += len;
+        if (flags & JS_ESCAPE_ASCII)
+          d = put_escape(d, codepoint);
+      } else
+#endif
+      if (decode(&state, &codepoint, *s++) == UTF8_ACCEPT) {
+        if (flags & JS_ESCAPE_ASCII)
+          d = put_escape(d, codepoint);
+      } else if (state == UTF8_REJECT) {
+        return -1;
+      }
+    } while (s < srcend && (state != UTF8_ACCEPT || *s >= 0x80));
+    if (state != UTF8_ACCEPT)
+      return -1;
+    if (!(flags & JS_ESCAPE_ASCII)) {
+      memcpy(d, run, s - run);
+      d += s - run;
+    }
+#endif
+  }
+  *destoff = d - dest;
+  return 0;
+}
+
+#ifdef THROUGHPUT
+#include <stdlib.h>
+#include <time.h>
+
+// Decode a generated string of SIZE bytes RUNS times and report the speed,
+// in chunks of CHUNK bytes if given (streaming API).
+// Shapes: ascii (printable, no escapes), mixed (some escapes and two-byte
+// UTF-8 sequences), escapes (one escape every other character), unicode
+// (only \uXXXX escapes, some of them surrogate pairs, like escaped
+// non-Latin text).
+static void generate(uint8_t *s, size_t size, const char *shape)
+{
+  size_t i = 0;
+  srand(44);
+  while (i < size) {
+    int r = rand() % 16;
+    if (!strcmp(shape, "mixed") && r == 0 && i + 2 <= size) {
+      s[i++] = '\\';
+      s[i++] = 'n';
+    } else if (!strcmp(shape, "mixed") && r == 1 && i + 2 <= size) {
+      s[i++] = 0xc3; // é
+      s[i++] = 0xa9;
+    } else if (!strcmp(shape, "unicode") && r == 0 && i + 12 <= size) {
+      memcpy(s + i, "\\ud83d\\ude00", 12); // 😀
+      i += 12;
+    } else if (!strcmp(shape, "unicode") && i + 6 <= size) {
+      // Cyrillic
+      memcpy(s + i, "\\u04", 4);
+      s[i + 4] = "0123456789abcdef"[3 + r % 2];
+      s[i + 5] = "0123456789ABCDEF"[r];
+      i += 6;
+    } else if (!strcmp(shape, "escapes") && i + 3 <= size) {
+      s[i++] = 'a' + r;
+      s[i++] = '\\';
+      s[i++] = 't';
+    } else {
+      s[i++] = 'a' + r;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  const char *shape = argc >= 2 ? argv[1] : "ascii";
+  size_t size = argc >= 3 ? strtoul(argv[2], NULL, 10) : 1 << 20;
+  int runs = argc >= 4 ? atoi(argv[3]) : 100;
+  size_t chunk = argc >= 5 ? strtoul(argv[4], NULL, 10) : 0;
+  if (argc < 2 || size == 0 || runs <= 0) {
+    fprintf(stderr, "Usage: %s {ascii|mixed|escapes|unicode} [SIZE] [RUNS] [CHUNK]\n", argv[0]);
+    return 1;
+  }
+  uint8_t *s = malloc(size);
+  uint16_t *d = malloc(size * sizeof *d);
+  generate(s, size, shape);
+
+  struct timespec t0, t1;
+  size_t ofs = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < runs; i++) {
+    int r;
+    ofs = 0;
+    if (chunk) {
+      js_decoder st;
+      _js_decoder_init(&st);
+      r = 0;
+      for (size_t p = 0; p < size && !r; p += chunk)
+        r = _js_decode_chunk(&st, d, &ofs, s + p,
+            s + (size - p < chunk ? size : p + chunk));
+      if (!r)
+        r = _js_decode_finish(&st);
+    } else {
+      r = _js_decode_string(d, &ofs, s, s + size);
+    }
+    if (r) {
+      fprintf(stderr, "decoding error\n");
+      return 1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("%s %zu bytes -> %zu units: %.3f GB/s\n",
+      shape, size, ofs, (double) size * runs / ns);
+
+  size_t units = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < runs; i++)
+    units = _js_decoded_length(s, s + size);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("length %zu units: %.3f GB/s\n", units, (double) size * runs / ns);
+  if (units != ofs) {
+    fprintf(stderr, "wrong length\n");
+    return 1;
+  }
+
+  // Only meaningful for shapes without escapes (it stops at the first one)
+  int valid = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < runs; i++)
+    valid = _js_validate_string(s, s + size);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("validate %d: %.3f GB/s\n", valid, (double) size * runs / ns);
+
+  uint64_t *bitmap = malloc((size + 63) / 64 * sizeof *bitmap);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < runs; i++)
+    _js_escape_bitmap(s, size, bitmap);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("bitmap: %.3f GB/s\n", (double) size * runs / ns);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < runs; i++) {
+    ofs = 0;
+    if (_js_decode_string_bitmap(d, &ofs, s, s + size, bitmap, s)) {
+      fprintf(stderr, "decoding error\n");
+      return 1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("decode with bitmap: %.3f GB/s\n", (double) size * runs / ns);
+  free(bitmap);
+
+  uint8_t *u = malloc(size);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (int i = 0; i < runs; i++) {
+    ofs = 0;
+    if (_js_unescape_utf8(u, &ofs, s, s + size)) {
+      fprintf(stderr, "decoding error\n");
+      return 1;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  printf("utf8 %zu bytes: %.3f GB/s\n", ofs, (double) size * runs / ns);
+
+  // Escaping back, in GB/s of output, to compare with the decoding
+  size_t utf8 = ofs;
+  uint8_t *e = malloc(6 * units);
+  uint16_t *back = malloc(units * sizeof *back);
+  for (int flags = 0; flags <= JS_ESCAPE_ASCII; flags++) {
+    const char *what = flags ? "ascii" : "utf8";
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < runs; i++) {
+      ofs = 0;
+      if (_js_escape_utf16(e, &ofs, d, d + units, flags)) {
+        fprintf(stderr, "escaping error\n");
+        return 1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("escape utf16 to %s %zu bytes: %.3f GB/s\n",
+        what, ofs, (double) ofs * runs / ns);
+    size_t e_units = 0;
+    if (_js_decode_string(back, &e_units, e, e + ofs) || e_units != units
+        || memcmp(back, d, units * sizeof *d)) {
+      fprintf(stderr, "no round trip\n");
+      return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < runs; i++) {
+      ofs = 0;
+      if (_js_escape_utf8(e, &ofs, u, u + utf8, flags)) {
+        fprintf(stderr, "escaping error\n");
+        return 1;
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    printf("escape utf8 to %s %zu bytes: %.3f GB/s\n",
+        what, ofs, (double) ofs * runs / ns);
+  }
+  free(back);
+  free(e);
+  free(u);
+  free(s);
+  free(d);
+  return 0;
+}
+
+#elif defined(DFA_CHECK)
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef ASCII_SOURCE
+#error "DFA_CHECK: ASCII_SOURCE has no DFA"
+#endif
+
+// Check that the three DFA implementations agree, then time them.
+
+static int failures;
+
+// One step of the three from the same (table) state; the shift state is half
+static void check_step(uint32_t state, uint32_t codep, uint32_t byte,
+                       uint32_t *next, uint32_t *next_codep)
+{
+  uint32_t st = state, sf = state, ss = state / 2;
+  uint32_t ct = codep, cf = codep, cs = codep;
+  decode_table(&st, &ct, byte);
+  decode_flow(&sf, &cf, byte);
+  decode_shift(&ss, &cs, byte);
+  if (st != sf || st != 2 * ss || ((st == UTF8_ACCEPT) && (ct != cf || ct != cs))) {
+    if (failures++ < 10)
+      printf("state %u byte %02x codep %x: table %u %x, flow %u %x, shift %u %x\n",
+          state, byte, codep, st, ct, sf, cf, ss, cs);
+  }
+  *next = st;
+  *next_codep = ct;
+}
+
+// All byte sequences from the accept state up to the next accept or
+// reject: since the automata agree on every transition, on every input.
+static long check_paths(uint32_t state, uint32_t codep, int depth)
+{
+  long paths = 0;
+  for (uint32_t byte = 0; byte < 256; byte++) {
+    uint32_t next, next_codep;
+    check_step(state, codep, byte, &next, &next_codep);
+    if (next == UTF8_ACCEPT || next == 12 || depth == 4)
+      paths++;
+    else
+      paths += check_paths(next, next_codep, depth + 1);
+  }
+  return paths;
+}
+
+// multibyte() against the automaton on every sequence of up to 4 bytes
+// (the fourth one only after 4-byte leads): same codepoint and length when it
+// takes a sequence, and it takes every valid one.
+static long check_multibyte(void)
+{
+  long sequences = 0;
+  uint8_t s[4];
+  for (uint32_t i = 0; i < 1 << 24; i++) {
+    s[0] = i >> 16;
+    s[1] = i >> 8;
+    s[2] = i;
+    for (uint32_t last = 0; last < (s[0] >= 0xf0 ? 256 : 1); last++) {
+      s[3] = last;
+      sequences++;
+      uint32_t state = UTF8_ACCEPT, codep = 0, c = 0;
+      unsigned len = 0;
+      do
+        decode_table(&state, &codep, s[len++]);
+      while (len < 4 && state != UTF8_ACCEPT && state != UTF8_REJECT);
+      unsigned n = multibyte(s, s + 4, &c);
+      int valid = state == UTF8_ACCEPT && len > 1;
+      if (valid ? n != len || c != codep : n != 0) {
+        if (failures++ < 10)
+          printf("multibyte %02x %02x %02x %02x: %u %x, table %u %x\n",
+              s[0], s[1], s[2], s[3], n, c, valid ? len : 0, codep);
+      }
+    }
+  }
+  return sequences;
+}
+
+// Time per byte, validating only (the codepoint is dead code then: this is
+// the latency of the state chain) and decoding (summing the codepoints).
+#define TIME_DECODER(name) {\
+    uint32_t valid = 0, state = 0, codep = 0, sum = 0;\
+    struct timespec t0, t1, t2;\
+    clock_gettime(CLOCK_MONOTONIC, &t0);\
+    for (int r = 0; r < runs; r++)\
+      for (size_t i = 0; i < size; i++) {\
+        uint32_t unused = 0;\
+        name(&valid, &unused, s[i]);\
+      }\
+    clock_gettime(CLOCK_MONOTONIC, &t1);\
+    for (int r = 0; r < runs; r++)\
+      for (size_t i = 0; i < size; i++)\
+        if (name(&state, &codep, s[i]) == UTF8_ACCEPT)\
+          sum += codep;\
+    clock_gettime(CLOCK_MONOTONIC, &t2);\
+    printf("%-12s validate %.3f ns/byte, decode %.3f ns/byte (%x %x)\n", #name,\
+        ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / size / runs,\
+        ((t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec)) / size / runs,\
+        valid, sum);\
+  }
+
+int main(void)
+{
+  // Transitions from every state on every byte, including reject
+  for (uint32_t state = 0; state <= 96; state += 12)
+    for (uint32_t byte = 0; byte < 256; byte++) {
+      uint32_t next, next_codep;
+      check_step(state, 0x2a, byte, &next, &next_codep);
+    }
+  long paths = check_paths(UTF8_ACCEPT, 0, 1);
+  printf("%ld sequences checked, %d failures\n", paths, failures);
+  if (failures)
+    return 1;
+  long sequences = check_multibyte();
+  printf("multibyte: %ld sequences checked, %d failures\n", sequences, failures);
+  if (failures)
+    return 1;
+
+  // Latency: every step depends on the state of the previous one.
+  // Random mix of 1 to 4-byte codepoints.
+  size_t size = 1 << 20;
+  int runs = 50;
+  uint8_t *s = malloc(size + 4);
+  srand(44);
+  for (size_t i = 0; i < size; ) {
+    uint32_t c;
+    switch (rand() % 4) {
+      case 0: c = rand() % 0x80; break;
+      case 1: c = 0x80 + rand() % 0x780; break;
+      case 2: c = 0xe000 + rand() % 0x2000; break;
+      default: c = 0x10000 + rand() % 0x100000; break;
+    }
+    i = put_utf8(s + i, c) - s;
+  }
+  TIME_DECODER(decode_table)
+  TIME_DECODER(decode_flow)
+  TIME_DECODER(decode_shift)
+  free(s);
+  return 0;
+}
+
+#elif defined(KERNEL)
+// No main in the library
+
+#else
+// Size of the input, or its maximum with SYMBOLIC_LENGTH
+#ifndef SIZE
 #define SIZE 12
+#endif
 
 #ifdef BUG_DEST_TOO_SMALL
 #define DSIZE 2
@@ -284,6 +1909,104 @@ int _js_decode_string(uint16_t *const dest, size_t *destoff,
 #define DSIZE SIZE
 #endif
 
+#ifndef ENCODER
+// Length of the input s: SIZE, or any length up to SIZE, so that one run
+// covers every shorter input too.
+static size_t input_length(const uint8_t *s)
+{
+#ifdef SYMBOLIC_LENGTH
+  uint8_t len;
+  klee_make_symbolic(&len, sizeof len, "len");
+  klee_assume(len <= SIZE);
+#else
+  size_t len = SIZE;
+#endif
+#ifdef SLICE
+  // Disjoint slices for make klee-slices
+#ifdef SLICE_BY_LEAD
+  // Class of the first byte (if any) for the decoder
+  uint8_t c = s[0];
+  if (len > 0) {
+    switch (SLICE) {
+      case 0: klee_assume((c < 0x80) & (c != '\\')); break; // ASCII
+      case 1: klee_assume(c == '\\'); break;
+      case 2: klee_assume((c >= 0xc2) & (c <= 0xdf)); break; // UTF-8 leads
+      case 3: klee_assume((c >= 0xe0) & (c <= 0xef)); break;
+      case 4: klee_assume((c >= 0xf0) & (c <= 0xf4)); break;
+      default: klee_assume(((c >= 0x80) & (c <= 0xc1)) | (c >= 0xf5)); // Invalid
+    }
+  } else if (SLICE) {
+    klee_silent_exit(0); // the empty input belongs to slice 0
+  }
+#elif defined(SYMBOLIC_LENGTH)
+  klee_assume(len == SLICE);
+#else
+#error "Slices by length need SYMBOLIC_LENGTH"
+#endif
+#endif
+  return len;
+}
+#endif
+
+#ifdef UTF8_OUTPUT
+int main(void) {
+  uint8_t s[SIZE], in_place[SIZE];
+  uint8_t d[DSIZE];
+  size_t ofs = 0, ofs_in_place = 0;
+
+  klee_make_symbolic(s, sizeof s, "s");
+  size_t n = input_length(s);
+  memcpy(in_place, s, n);
+
+  int r = _js_unescape_utf8(d, &ofs, s, s+n);
+  // Same result in place
+  if (r != _js_unescape_utf8(in_place, &ofs_in_place, in_place, in_place+n))
+    klee_abort();
+  if (r == -1)
+    return 1;
+  if (ofs != ofs_in_place || memcmp(d, in_place, ofs))
+    klee_abort();
+
+  return 0;
+}
+#elif defined(ENCODER)
+// Round trips: escaping a string and decoding the result gives it back
+#define USIZE 4
+int main(void) {
+  uint16_t u[USIZE], u_back[USIZE];
+  uint8_t s[SIZE], s_back[6 * SIZE];
+  uint8_t e[6 * SIZE];
+  uint8_t ascii;
+  size_t ofs = 0, back = 0;
+
+  klee_make_symbolic(u, sizeof u, "u");
+  klee_make_symbolic(s, sizeof s, "s");
+  klee_make_symbolic(&ascii, sizeof ascii, "ascii");
+  int flags = ascii ? JS_ESCAPE_ASCII : 0;
+
+  // Fails only on unpaired surrogates, which do not decode
+  if (_js_escape_utf16(e, &ofs, u, u + USIZE, flags) == 0) {
+    for (size_t i = 0; i < ofs; i++)
+      if (e[i] < 0x20 || (flags && e[i] >= 0x80))
+        klee_abort();
+    if (_js_decode_string(u_back, &back, e, e + ofs)
+        || back != USIZE || memcmp(u, u_back, sizeof u))
+      klee_abort();
+  }
+
+  ofs = back = 0;
+  if (_js_escape_utf8(e, &ofs, s, s + SIZE, flags))
+    return 1;
+  for (size_t i = 0; i < ofs; i++)
+    if (e[i] < 0x20 || (flags && e[i] >= 0x80))
+      klee_abort();
+  if (_js_unescape_utf8(s_back, &back, e, e + ofs)
+      || back != SIZE || memcmp(s, s_back, SIZE))
+    klee_abort();
+
+  return 0;
+}
+#else
 int main(void) {
   uint8_t s[SIZE];
   uint16_t d[DSIZE];
@@ -293,9 +2016,21 @@ int main(void) {
   // klee_assume(s[0] == 'a');
   // klee_assume(s[1] == 'b');
   // klee_assume(s[2] == 'c');
+  size_t n = input_length(s);
 
-  if (-1 == _js_decode_string(d, &ofs, s, s+SIZE))
+#ifdef BOUNDED_DEST
+  // Never writes out of d, whatever DSIZE; the measured length is exact
+  int r = _js_decode_string_bounded(d, &ofs, d + DSIZE, s, s+n);
+  if (r == 0 && ofs != _js_decoded_length(s, s+n))
+    klee_abort();
+  if (r < 0)
+    return 1;
+#else
+  if (-1 == _js_decode_string(d, &ofs, s, s+n))
     return 1;
+#endif
 
   return 0;
 }
+#endif
+#endif
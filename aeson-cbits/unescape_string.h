@@ -0,0 +1,117 @@
+// JSON string decoding and escaping: public functions of unescape_string.c
+// and, in the library build (make lib), the selection of a kernel at load
+// time.
+
+#ifndef UNESCAPE_STRING_H
+#define UNESCAPE_STRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// State of a decoder between two chunks of input. Its meaning depends on
+// the kernel: a decoder must be finished by the kernel that started it.
+typedef struct {
+  uint32_t state;     // DFA state
+  uint32_t codepoint; // partial UTF-8 codepoint
+  uint16_t unidata;   // partial \uXXXX value
+  uint8_t surrogate;  // a high surrogate must be followed by a low one
+  uint8_t escape;     // enum js_escape
+} js_decoder;
+
+void _js_escape_bitmap(const uint8_t *s, size_t len, uint64_t *bitmap);
+void _js_decoder_init(js_decoder *st);
+int _js_decode_chunk(js_decoder *st, uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend);
+int _js_decode_finish(const js_decoder *st);
+int _js_decode_string(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend);
+int _js_decode_string_bounded(uint16_t *const dest, size_t *destoff,
+                  uint16_t *const destend,
+                  const uint8_t *s, const uint8_t *const srcend);
+int _js_decode_string_bitmap(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  const uint64_t *bitmap, const uint8_t *origin);
+size_t _js_decoded_length(const uint8_t *s, const uint8_t *const srcend);
+int _js_unescape_utf8(uint8_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend);
+// 0: valid UTF-8 without escapes, its own decoding; 1: has escapes; -1:
+// invalid
+int _js_validate_string(const uint8_t *s, const uint8_t *const srcend);
+
+// One string of a batch
+typedef struct {
+  const uint8_t *s; // source
+  size_t len;
+  size_t offset;    // set by the decoding: first code unit in the arena
+  size_t length;    // and number of code units
+} js_span;
+
+size_t _js_decode_batch(js_span *spans, size_t n, uint16_t *arena,
+                  uint64_t *errors);
+
+// Escaping flag: non-ASCII characters as \uXXXX too
+#define JS_ESCAPE_ASCII 1
+
+int _js_escape_utf16(uint8_t *const dest, size_t *destoff,
+                  const uint16_t *s, const uint16_t *const srcend, int flags);
+int _js_escape_utf8(uint8_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend, int flags);
+
+#ifdef DFA_COUNTERS
+// Steps of the UTF-8 automaton, by state (row i for state 12 * i of the
+// table) and character class. Counted per thread: flushing adds the counts of
+// the calling thread to the totals, which the other function reads.
+#define JS_DFA_STATES 9
+#define JS_DFA_CLASSES 12
+
+void _js_dfa_counters_flush(void);
+void _js_dfa_counters(uint64_t counts[JS_DFA_STATES][JS_DFA_CLASSES]);
+#endif
+
+// One build of the functions above
+typedef struct {
+  const char *name;
+  void (*escape_bitmap)(const uint8_t *, size_t, uint64_t *);
+  void (*decoder_init)(js_decoder *);
+  int (*decode_chunk)(js_decoder *, uint16_t *, size_t *,
+                      const uint8_t *, const uint8_t *);
+  int (*decode_finish)(const js_decoder *);
+  int (*decode_string)(uint16_t *, size_t *, const uint8_t *, const uint8_t *);
+  int (*decode_string_bounded)(uint16_t *, size_t *, uint16_t *,
+                               const uint8_t *, const uint8_t *);
+  int (*decode_string_bitmap)(uint16_t *, size_t *, const uint8_t *,
+                              const uint8_t *, const uint64_t *,
+                              const uint8_t *);
+  size_t (*decoded_length)(const uint8_t *, const uint8_t *);
+  int (*unescape_utf8)(uint8_t *, size_t *, const uint8_t *, const uint8_t *);
+  int (*validate_string)(const uint8_t *, const uint8_t *);
+  size_t (*decode_batch)(js_span *, size_t, uint16_t *, uint64_t *);
+  int (*escape_utf16)(uint8_t *, size_t *, const uint16_t *, const uint16_t *,
+                      int);
+  int (*escape_utf8)(uint8_t *, size_t *, const uint8_t *, const uint8_t *,
+                     int);
+} js_kernel;
+
+// Library only (dispatch.c). The functions above call the current kernel:
+// the fastest one the CPU supports, unless the environment variable
+// JS_DECODE_KERNEL names another one.
+
+// Same as _js_decode_string, on up to threads threads (0: one per CPU), for
+// strings of megabytes (parallel_decode.c)
+int _js_decode_string_parallel(uint16_t *const dest, size_t *destoff,
+                  const uint8_t *s, const uint8_t *const srcend,
+                  unsigned threads);
+
+// Same as _js_decode_batch, on up to threads threads (0: one per CPU), for
+// batches of megabytes (parallel_decode.c)
+size_t _js_decode_batch_parallel(js_span *spans, size_t n, uint16_t *arena,
+                  uint64_t *errors, unsigned threads);
+
+// i-th kernel this CPU can run, fastest first, NULL past the last one
+const js_kernel *_js_kernel_at(size_t i);
+const js_kernel *_js_kernel_current(void);
+// Make the kernel called name current, return -1 if there is none the CPU
+// can run.
+int _js_kernel_select(const char *name);
+
+#endif
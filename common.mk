@@ -43,6 +43,35 @@ $(TARGET).replay-c: $(ARTIFACT).c
 klee: $(TARGET).bc
 	$(KLEE) $(OUTPUT_STATES) $(TIMEOUT_OPT) $(EXTRA_OPTS) $<
 
+# Coverage-guided fuzzing with libFuzzer, for TIMEOUT seconds unless
+# NOLIMIT, growing the corpus in $(TARGET).corpus/. Each Makefile builds
+# $(TARGET).fuzz with clang and FUZZ_SANITIZE.
+FUZZ_SANITIZE=-g -O1 -fsanitize=address,undefined
+
+ifndef NOLIMIT
+FUZZ_TIME_OPT:=-max_total_time=$(TIMEOUT)
+endif
+
+fuzz: $(TARGET).fuzz
+	@mkdir -p $(TARGET).corpus
+	./$< $(FUZZ_TIME_OPT) $(FUZZ_OPTS) $(TARGET).corpus
+
+# Partitioned campaigns: every slice in $(SLICES) is built with
+# -DSLICE=<slice> $(SLICE_OPTS) and explored by its own Klee process.
+# Use `make -j N klee-slices` to run N slices at a time.
+SLICE_DIR:=$(TARGET).slices
+
+$(TARGET).slice%.bc: $(ARTIFACT).c buildanyway
+	$(CC) $(CCOPTS) $(CCBUILDOPTS) $(CC_EXTRA_OPTS) $(BUGS) -DSLICE=$* $(SLICE_OPTS) $< -o $@
+
+$(SLICE_DIR)/slice%: $(TARGET).slice%.bc buildanyway
+	@mkdir -p $(SLICE_DIR)
+	rm -rf $@
+	$(KLEE) -output-dir=$@ $(OUTPUT_STATES) $(TIMEOUT_OPT) $(EXTRA_OPTS) $<
+
+klee-slices: $(SLICES:%=$(SLICE_DIR)/slice%)
+	KLEE_STATS=$(dir $(KLEE))klee-stats ../misc/merge_klee_out.sh $(SLICE_DIR)/merged $^
+
 replay: $(TARGET).replay
 	@bash -c 'if [[ -f "$(TEST_FILE)" ]] ; then \
 	  LD_LIBRARY_PATH=$(KLEE_LIB) KTEST_FILE=$(TEST_FILE) ./$< ; \
@@ -57,7 +86,20 @@ coverage: $(TARGET).replay-c
 	gcov -a $(ARTIFACT).c | tee $(KLEE_OUT)/gcov_out
 	cp $(ARTIFACT).c.gcov $(KLEE_OUT)/
 
+ifndef JOBS
+JOBS:=$(shell nproc)
+endif
+
+distill: $(TARGET).replay-c
+	@test $(KLEE_OUT) || (echo "make distill: KLEE_OUT is undefined" ; exit 1)
+	KLEE_LIB=$(KLEE_LIB) ../misc/distill.sh ./$< $(ARTIFACT).c $(KLEE_OUT) $(KLEE_OUT)/distilled $(JOBS)
+
+# Name of the build for the current options (used by misc/bench.sh)
+print-target:
+	@echo $(TARGET)
+
 clean:
-	rm -f *.bc *.c-prepro *.manual *.replay *.replay-c *.gcov *.gcda *.gcno
+	rm -rf *.slices
+	rm -f *.bc *.c-prepro *.manual *.replay *.replay-c *.gcov *.gcda *.gcno *.fuzz
 
-.PHONY: clean build cpp coverage klee
+.PHONY: clean build cpp coverage distill fuzz klee klee-slices print-target
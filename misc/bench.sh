@@ -0,0 +1,298 @@
+#!/usr/bin/env bash
+# Run every seeded bug under every available engine and collect the criteria
+# of LOG.md in one table.
+#
+#   bench.sh [-u]
+#
+# Engines (ENGINES, default: all of them; missing ones are skipped):
+# - random: noninterf RANDOM build, RUNS tests per seed in SEEDS;
+# - explore: noninterf built-in explorer, stopping at the first counterexample;
+# - klee, klee-lean: Klee with the default and the LEAN (noninterf only)
+#   harnesses, stopping at the first error;
+# - steps: interpreter throughput of the noninterf RANDOM build with
+#   CONTROL_FLOW, for each program length in LENGTHS (default: 100 1000
+#   4000), in OUT/steps.tsv:
+#
+#     prg_length tests tests_per_sec steps steps_per_sec
+#
+# The bugs of the control flow instructions are not run by explore, which
+# does not model them. They are built with PRG_LENGTH=CF_LENGTH (default 8):
+# BUG_RETURN and BUG_STORE_PC need a call, a return and a halt around the
+# faulty instruction, which programs of 4 instructions never hold. random runs
+# CF_RUNS (default 50000000) tests of them: at length 8, one test in about
+# 8 million fails under BUG_STORE_PC (the first ones of seeds 1, 2 and 3 are
+# tests 19442807, 16488690 and 1939835).
+# Every run is limited to BUDGET seconds.
+#
+# Results go to OUT/results.tsv (OUT defaults to bench), one line per run:
+#
+#   artifact variant engine seed found ttf tests tests_per_sec tests_to_failure icov bcov tsolver
+#
+# ttf is the time to the first failure in seconds (the run time if none;
+# CPU time for random, as its tests_per_sec), tests_to_failure the number of tests (random), complete paths (explore) or
+# emitted test cases (Klee) up to and including the first failure. Unknown
+# or irrelevant fields are "-".
+#
+# The results are compared with BASELINE (default misc/bench-baseline.tsv):
+# a run regresses if it no longer finds its bug, if its ttf grows by more than
+# TOL (default 0.25, i.e. 25%) plus SLACK seconds (default 0.5), or if its
+# tests_per_sec drops by more than TOL. The exit status is 1 on regressions.
+# With -u, the results replace the baseline instead.
+
+set -uo pipefail
+
+root=$(realpath "$(dirname "$0")/..")
+cd "$root"
+
+update=""
+if [[ "${1:-}" == "-u" ]]; then
+  update=1
+elif [[ $# -gt 0 ]]; then
+  echo "Usage: $0 [-u]" >&2
+  exit 1
+fi
+
+engines=${ENGINES:-random explore klee klee-lean steps}
+budget=${BUDGET:-60}
+runs=${RUNS:-10000000}
+seeds=${SEEDS:-1 2 3}
+out=$(realpath -m "${OUT:-bench}")
+baseline=${BASELINE:-misc/bench-baseline.tsv}
+tol=${TOL:-0.25}
+slack=${SLACK:-0.5}
+klee=$(realpath -m "${KLEE:-klee/bin/klee}")
+klee_stats=$(dirname "$klee")/klee-stats
+
+noninterf_bugs="BUG_ADD BUG_STORE BUG_STORE_2 BUG_LOAD"
+noninterf_cf_bugs="BUG_JUMP BUG_BNZ BUG_CALL BUG_RETURN BUG_STORE_PC"
+lengths=${LENGTHS:-100 1000 4000}
+cf_length=${CF_LENGTH:-8}
+cf_runs=${CF_RUNS:-50000000}
+aeson_bugs="DEST_TOO_SMALL DEST_TOO_SMALL_BIS"
+
+rm -rf "$out"
+mkdir -p "$out"
+results=$out/results.tsv
+printf "artifact\tvariant\tengine\tseed\tfound\tttf\ttests\ttests_per_sec\ttests_to_failure\ticov\tbcov\ttsolver\n" > "$results"
+
+has_engine() {
+  [[ " $engines " == *" $1 "* ]]
+}
+
+# make in a subdirectory, quietly; extra variables override the Makefile
+# (e.g. CC=gcc where clang is not available).
+run_make() {
+  local dir=$1
+  shift
+  make --no-print-directory -s -C "$dir" ${CC:+CC=$CC} "$@" > "$out/make.log" 2>&1
+}
+
+# Extra make variables of a bug
+bug_opts() {
+  [[ " $noninterf_cf_bugs " == *" $1 "* ]] && echo "PRG_LENGTH=$cf_length"
+}
+
+# Random tests of a bug
+bug_runs() {
+  if [[ " $noninterf_cf_bugs " == *" $1 "* ]]; then
+    echo "$cf_runs"
+  else
+    echo "$runs"
+  fi
+}
+
+row() {
+  local IFS=$'\t'
+  echo "$*" | tee -a "$results"
+}
+
+ratio() {
+  awk -v a="$1" -v b="$2" 'BEGIN { if (b > 0) printf "%.1f", a / b; else print "-" }'
+}
+
+# Each seed is a campaign checkpointed to OUT: stopped by the budget, it
+# saves and prints its counts so far, and the checkpoint has its CPU time,
+# the clock of its time to failure.
+bench_random() {
+  local bug=$1 exe seed checkpoint
+  run_make noninterf random "$bug=true" $(bug_opts "$bug") || { echo "random: build failed for $bug" >&2; return; }
+  exe=noninterf/$(make --no-print-directory -s -C noninterf "$bug=true" $(bug_opts "$bug") print-target).rand
+  for seed in $seeds; do
+    local good="" bad="" ugly="" first="" first_time="" elapsed=""
+    checkpoint=$out/random.$bug.$seed
+    rm -f "$checkpoint"
+    timeout "$budget" "$exe" -c "$checkpoint" "$(bug_runs "$bug")" "$seed" \
+      > /dev/null 2>> "$out/random.err"
+    # good bad ugly
+    # first INDEX SECONDS
+    # campaign SEED FIRST RUNS NEXT SECONDS
+    if [[ -f "$checkpoint" ]]; then
+      read -r good bad ugly <<< "$(sed -n 1p "$checkpoint")"
+      read -r _ first first_time <<< "$(sed -n 2p "$checkpoint")"
+      read -r _ _ _ _ _ elapsed <<< "$(sed -n 3p "$checkpoint")"
+    fi
+    if [[ -z "${elapsed:-}" ]]; then
+      echo "random: no result for $bug, seed $seed, see $out/random.err" >&2
+      row noninterf "$bug" random "$seed" 0 "$budget" - - - - - -
+      continue
+    fi
+    local tests=$((good + bad + ugly))
+    if [[ "$first" -gt 0 ]]; then
+      row noninterf "$bug" random "$seed" 1 "$first_time" "$tests" "$(ratio "$tests" "$elapsed")" "$first" - - -
+    else
+      row noninterf "$bug" random "$seed" 0 "$elapsed" "$tests" "$(ratio "$tests" "$elapsed")" - - - -
+    fi
+  done
+}
+
+bench_explore() {
+  local bug=$1 exe output
+  run_make noninterf explore "$bug=true" || { echo "explore: build failed for $bug" >&2; return; }
+  exe=noninterf/$(make --no-print-directory -s -C noninterf "$bug=true" print-target).explore
+  # paths N cex N discarded N pruned N unknown N merged N time T [first T]
+  # [interrupted]
+  output=$(timeout "$budget" "$exe" -f -q | tail -n 1)
+  if [[ -z "$output" ]]; then
+    row noninterf "$bug" explore - 0 "$budget" - - - - - -
+    return
+  fi
+  awk -v bug="$bug" '{
+      for (i = 1; i < NF; i += 2) v[$i] = $(i + 1)
+      tests = v["paths"] + v["cex"] + v["discarded"]
+      tps = v["time"] > 0 ? sprintf("%.1f", tests / v["time"]) : "-"
+      if (v["cex"] > 0)
+        printf "noninterf\t%s\texplore\t-\t1\t%s\t%d\t%s\t%d\t-\t-\t-\n", bug, v["first"], tests, tps, tests
+      else
+        printf "noninterf\t%s\texplore\t-\t0\t%s\t%d\t%s\t-\t-\t-\t-\n", bug, v["time"], tests, tps
+    }' <<< "$output" | tee -a "$results"
+}
+
+# Tests of the correct machine (seed 1) for BUDGET seconds at most; the
+# steps and their rate (per CPU second, as the tests) are on stderr:
+# "steps N PER_SEC".
+bench_steps() {
+  local len exe
+  printf "prg_length\ttests\ttests_per_sec\tsteps\tsteps_per_sec\n" > "$out/steps.tsv"
+  for len in $lengths; do
+    run_make noninterf random CONTROL_FLOW=true PRG_LENGTH="$len" \
+      || { echo "steps: build failed for $len" >&2; continue; }
+    exe=noninterf/$(make --no-print-directory -s -C noninterf CONTROL_FLOW=true PRG_LENGTH="$len" print-target).rand
+    local good="" bad="" ugly="" elapsed="" steps="" rate=""
+    local checkpoint=$out/steps.$len
+    rm -f "$checkpoint"
+    timeout "$budget" "$exe" -c "$checkpoint" "$runs" 1 > /dev/null 2> "$out/steps.err"
+    if [[ -f "$checkpoint" ]]; then
+      read -r good bad ugly <<< "$(sed -n 1p "$checkpoint")"
+      read -r _ _ _ _ _ elapsed <<< "$(sed -n 3p "$checkpoint")"
+    fi
+    read -r _ steps rate < "$out/steps.err"
+    if [[ -z "${elapsed:-}" || -z "${steps:-}" ]]; then
+      echo "steps: no result for $len, see $out/steps.err" >&2
+      continue
+    fi
+    local tests=$((good + bad + ugly))
+    printf "%s\t%s\t%s\t%s\t%s\n" "$len" "$tests" "$(ratio "$tests" "$elapsed")" \
+      "$steps" "$rate" | tee -a "$out/steps.tsv"
+  done
+}
+
+# Columns of klee-stats for one run: Time(s) ICov(%) BCov(%) TSolver(%)
+klee_columns() {
+  "$klee_stats" "$1" 2> /dev/null | awk -F'|' '
+    /^\|/ {
+      if (!header) {
+        for (i = 2; i < NF; i++) { h = $i; gsub(/ /, "", h); col[h] = i }
+        header = 1
+        next
+      }
+      for (i = 2; i < NF; i++) gsub(/ /, "", $i)
+      print $col["Time(s)"], $col["ICov(%)"], $col["BCov(%)"], $col["TSolver(%)"]
+      exit
+    }'
+}
+
+bench_klee() {
+  local artifact=$1 bug=$2 engine=$3 error_type=$4
+  local dir=$out/klee/$artifact.$bug.$engine
+  local lean=""
+  [[ "$engine" == klee-lean ]] && lean="LEAN=true"
+  mkdir -p "$(dirname "$dir")"
+  timeout $((budget + 60)) make --no-print-directory -s -C "$artifact" ${CC:+CC=$CC} klee "$bug=true" $lean $(bug_opts "$bug") \
+    KLEE="$klee" TIMEOUT="$budget" \
+    EXTRA_OPTS="-exit-on-error-type=$error_type -output-dir=$dir" > "$out/make.log" 2>&1
+  if [[ ! -d "$dir" ]]; then
+    echo "$engine: no output for $artifact $bug, see $out/make.log" >&2
+    return
+  fi
+  local time icov bcov tsolver
+  read -r time icov bcov tsolver <<< "$(klee_columns "$dir")"
+  local tests
+  tests=$(ls "$dir"/*.ktest 2> /dev/null | wc -l)
+  local err
+  err=$(ls "$dir"/test*.err 2> /dev/null | sort | head -n 1)
+  if [[ -n "$err" ]]; then
+    # Klee writes assembly.ll before exploring, its mtime marks the start.
+    local ttf=$(( $(stat -c %Y "$err") - $(stat -c %Y "$dir/assembly.ll") ))
+    local n
+    n=$(basename "$err" | sed 's/^test0*\([0-9]*\)\..*/\1/')
+    row "$artifact" "$bug" "$engine" - 1 "$ttf" "$tests" "$(ratio "$tests" "${time:-0}")" "$n" "${icov:--}" "${bcov:--}" "${tsolver:--}"
+  else
+    row "$artifact" "$bug" "$engine" - 0 "${time:-$budget}" "$tests" "$(ratio "$tests" "${time:-0}")" - "${icov:--}" "${bcov:--}" "${tsolver:--}"
+  fi
+}
+
+have_klee=""
+if [[ -x "$klee" ]]; then
+  have_klee=1
+elif has_engine klee || has_engine klee-lean; then
+  echo "$klee not found, skipping Klee" >&2
+fi
+
+for bug in $noninterf_bugs $noninterf_cf_bugs; do
+  has_engine random && bench_random "$bug"
+  if has_engine explore && [[ " $noninterf_cf_bugs " != *" $bug "* ]]; then
+    bench_explore "$bug"
+  fi
+  if [[ -n "$have_klee" ]]; then
+    has_engine klee && bench_klee noninterf "$bug" klee Abort
+    has_engine klee-lean && bench_klee noninterf "$bug" klee-lean Abort
+  fi
+done
+has_engine steps && bench_steps
+if [[ -n "$have_klee" ]] && has_engine klee; then
+  for bug in $aeson_bugs; do
+    bench_klee aeson-cbits "$bug" klee Ptr
+  done
+fi
+
+if [[ -n "$update" ]]; then
+  cp "$results" "$baseline"
+  echo "baseline updated: $baseline"
+  exit 0
+fi
+if [[ ! -f "$baseline" ]]; then
+  echo "no baseline ($baseline), run $0 -u to record one"
+  exit 0
+fi
+
+# Columns: 1-4 key, 5 found, 6 ttf, 8 tests_per_sec
+awk -F'\t' -v tol="$tol" -v slack="$slack" '
+  FNR == 1 { next }
+  NR == FNR { key = $1 FS $2 FS $3 FS $4; found[key] = $5; ttf[key] = $6; tps[key] = $8; next }
+  {
+    key = $1 FS $2 FS $3 FS $4
+    if (!(key in found)) next
+    what = ""
+    if (found[key] == 1 && $5 != 1)
+      what = "bug no longer found"
+    else if (found[key] == 1 && $6 > ttf[key] * (1 + tol) + slack)
+      what = "ttf " ttf[key] " -> " $6
+    else if (tps[key] != "-" && $8 != "-" && $8 < tps[key] / (1 + tol))
+      what = "tests/s " tps[key] " -> " $8
+    if (what != "") {
+      printf "REGRESSION %s %s %s seed %s: %s\n", $1, $2, $3, $4, what
+      n++
+    }
+  }
+  END { if (n) exit 1; print "no regression against the baseline" }
+' "$baseline" "$results"
@@ -0,0 +1,148 @@
+#!/usr/bin/env bash
+# Distill a klee-out directory down to a minimal set of test cases with the
+# same line and branch coverage.
+#
+#   distill.sh REPLAY_C SOURCE KLEE_OUT OUT_DIR [JOBS]
+#
+# REPLAY_C is the gcov-instrumented replay executable (`make $(TARGET).replay-c`),
+# built with -DCOVERAGE so that the state machine switches in decode()
+# show up as branches. Every ktest is replayed once, in parallel, each with its
+# own GCOV_PREFIX so that the counters do not mix. The signature of a test is
+# the set of lines it executes and branches (edges) it takes. A greedy set
+# cover over the signatures picks the tests copied to OUT_DIR. Tests that
+# fail (an .err file from KLEE, or a nonzero or signal exit status on replay)
+# are always kept: they may die before gcov flushes their counters. Finally,
+# the merged gcov totals of the kept tests are checked against those of all
+# tests, and the script fails if they differ.
+
+set -euo pipefail
+
+if [[ $# -lt 4 ]]; then
+  echo "Usage: $0 REPLAY_C SOURCE KLEE_OUT OUT_DIR [JOBS]" >&2
+  exit 1
+fi
+
+replay=$(realpath "$1")
+source=$2
+klee_out=$3
+out=$4
+jobs=${5:-$(nproc)}
+klee_lib=${KLEE_LIB:-../klee/lib}
+gcno=$(ls "$replay"-*.gcno "${replay%.*}".gcno 2>/dev/null | head -n 1 || true)
+
+if [[ -z "$gcno" ]]; then
+  echo "$0: no notes file (.gcno) next to $replay" >&2
+  exit 1
+fi
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Replay one test; write its coverage signature to $work/$name.sig,
+# one feature per line: "L<line>" for executed lines,
+# "B<line>.<n>" for taken branches.
+signature() {
+  local t=$1
+  local name status
+  name=$(basename "$t" .ktest)
+  GCOV_PREFIX="$work/$name" GCOV_PREFIX_STRIP=64 \
+    LD_LIBRARY_PATH="$klee_lib" KTEST_FILE="$t" \
+    timeout 10 "$replay" > /dev/null 2>&1 && status=0 || status=$?
+  if [[ $status -ne 0 ]] || ls "${t%.ktest}".*.err > /dev/null 2>&1; then
+    touch "$work/$name.keep"
+  fi
+  local gcda
+  gcda=$(ls "$work/$name"/*.gcda 2>/dev/null | head -n 1 || true)
+  if [[ -z "$gcda" ]]; then
+    # Crashed before flushing the counters: empty signature, kept anyway
+    : > "$work/$name.sig"
+    return
+  fi
+  cp "$gcno" "${gcda%.gcda}.gcno"
+  gcov -b -c -t "$gcda" 2> /dev/null | awk '
+    /^ *[^ :]+: *[0-9]+:/ {
+      split($0, f, ":")
+      count = f[1]; gsub(/[ *]/, "", count)
+      line = f[2] + 0
+      if (count ~ /^[0-9]+$/ && count > 0) print "L" line
+      next
+    }
+    /^branch / { if ($4 ~ /^[0-9]+$/ && $4 > 0) print "B" line "." $2 }
+  ' | sort -u > "$work/$name.sig"
+}
+export -f signature
+export work gcno replay klee_lib
+
+ls "$klee_out"/*.ktest | xargs -P "$jobs" -I{} bash -c 'signature "$1"' _ {}
+
+mkdir -p "$out"
+rm -f "$out"/*.ktest
+
+# Greedy set cover: start from the failing tests, then repeatedly keep the
+# test that covers the most features not covered yet. Ties go to the earliest
+# test, so that runs are deterministic.
+( cd "$work" && ls *.sig ) | sort | sed 's/\.sig$//' > "$work/tests"
+failing=$( (cd "$work" && ls *.keep 2>/dev/null || true) | sort | sed 's/\.keep$//')
+kept=$(cd "$work" && awk -v failing="$failing" '
+  FNR == 1 { t = FILENAME; sub(/\.sig$/, "", t); order[n++] = t }
+  { feats[t] = feats[t] " " $0 }
+  END {
+    m = split(failing, ts, "\n")
+    for (i = 1; i <= m; i++) {
+      print ts[i]
+      k = split(feats[ts[i]], fs, " ")
+      for (j = 1; j <= k; j++) covered[fs[j]] = 1
+    }
+    while (1) {
+      best = ""; bestn = 0
+      for (i = 0; i < n; i++) {
+        t = order[i]; c = 0
+        k = split(feats[t], fs, " ")
+        for (j = 1; j <= k; j++) if (!(fs[j] in covered)) c++
+        if (c > bestn) { best = t; bestn = c }
+      }
+      if (bestn == 0) break
+      print best
+      k = split(feats[best], fs, " ")
+      for (j = 1; j <= k; j++) covered[fs[j]] = 1
+    }
+  }' $(sed 's/$/.sig/' tests))
+
+for t in $kept; do
+  cp "$klee_out/$t.ktest" "$out/"
+done
+
+# Replay the given tests one after the other into $work/$1, so that the
+# counters add up, and print the gcov totals ("Lines executed", ...).
+totals() {
+  local dir=$work/$1 t gcda
+  shift
+  for t in "$@"; do
+    GCOV_PREFIX="$dir" GCOV_PREFIX_STRIP=64 \
+      LD_LIBRARY_PATH="$klee_lib" KTEST_FILE="$t" \
+      timeout 10 "$replay" > /dev/null 2>&1 || true
+  done
+  gcda=$(ls "$dir"/*.gcda 2>/dev/null | head -n 1 || true)
+  [[ -n "$gcda" ]] || return 0
+  cp "$gcno" "${gcda%.gcda}.gcno"
+  (cd "$dir" && gcov -b -c -n "$gcda" 2> /dev/null) | grep -E '^(File|Lines|Branches|Taken|Calls)'
+}
+
+total=$(wc -l < "$work/tests")
+nkept=$(echo "$kept" | grep -c . || true)
+nfailing=$(echo "$failing" | grep -c . || true)
+nfeat=$(cat "$work"/*.sig | sort -u | wc -l)
+{
+  echo "source: $source"
+  echo "kept $nkept of $total tests ($nfailing failing), covering $nfeat lines and branches"
+  for t in $kept; do echo "$t"; done
+} | tee "$out/distill.txt"
+
+all_totals=$(totals all "$klee_out"/*.ktest)
+kept_totals=$(totals kept "$out"/*.ktest)
+if [[ "$all_totals" != "$kept_totals" ]]; then
+  echo "$0: distilled coverage differs from the full set" >&2
+  diff <(echo "$all_totals") <(echo "$kept_totals") >&2 || true
+  exit 1
+fi
+echo "$all_totals" | tee -a "$out/distill.txt"
@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+# Merge the output directories of several Klee runs (e.g. the slices of a
+# partitioned campaign) into one directory.
+#
+#   merge_klee_out.sh OUT_DIR KLEE_OUT...
+#
+# Test cases are renumbered in argument order, together with their error
+# reports (test*.err), so that `make replay`, `make coverage` and
+# `make distill` work on OUT_DIR as on any klee-out directory.
+# OUT_DIR/slices.txt maps every merged test back to its origin and
+# OUT_DIR/klee-stats.txt holds the statistics of every run.
+
+set -euo pipefail
+
+if [[ $# -lt 2 ]]; then
+  echo "Usage: $0 OUT_DIR KLEE_OUT..." >&2
+  exit 1
+fi
+
+out=$1
+shift
+klee_stats=${KLEE_STATS:-$(dirname "${KLEE:-../klee/bin/klee}")/klee-stats}
+
+rm -rf "$out"
+mkdir -p "$out"
+
+n=0
+first_error=""
+first_error_time=""
+for dir in "$@"; do
+  # Klee writes assembly.ll before exploring, its mtime marks the start.
+  start=$(stat -c %Y "$dir/assembly.ll" 2>/dev/null || echo "")
+  for t in "$dir"/test*.ktest; do
+    [[ -e "$t" ]] || continue
+    n=$((n + 1))
+    new=$(printf "test%06d" "$n")
+    old=$(basename "$t" .ktest)
+    cp "$t" "$out/$new.ktest"
+    for e in "$dir/$old".*.err; do
+      [[ -e "$e" ]] || continue
+      cp "$e" "$out/$new.${e#$dir/$old.}"
+      if [[ -n "$start" ]]; then
+        elapsed=$(( $(stat -c %Y "$e") - start ))
+        if [[ -z "$first_error_time" || "$elapsed" -lt "$first_error_time" ]]; then
+          first_error_time=$elapsed
+          first_error="$dir/$old ($new)"
+        fi
+      fi
+    done
+    echo "$new $dir/$old" >> "$out/slices.txt"
+  done
+done
+
+if [[ -x "$klee_stats" ]]; then
+  "$klee_stats" "$@" > "$out/klee-stats.txt" || true
+  cat "$out/klee-stats.txt"
+fi
+
+echo "merged $n tests from $# runs into $out"
+if [[ -n "$first_error" ]]; then
+  echo "first error after ${first_error_time}s: $first_error" | tee "$out/first-error.txt"
+fi
@@ -0,0 +1,62 @@
+#!/usr/bin/env bash
+# Merge the results of the shards of a random testing campaign (checkpoint
+# files of `noninterf.rand -c`, see the RANDOM main of noninterf.c).
+#
+#   merge_random.sh CHECKPOINT...
+#
+# Prints, whatever the order of the arguments:
+#   good bad ugly          (summed)
+#   first INDEX SECONDS    (failure of lowest index, time within its shard)
+#   shards N TESTS SECONDS (tests run and CPU seconds, summed)
+#   failures N INDEX...    (the first 100 failures of all shards)
+# Shards of different seeds are an error; gaps or overlaps between the test
+# ranges of the shards and unfinished shards are reported on stderr.
+
+set -euo pipefail
+
+if [[ $# -lt 1 ]]; then
+  echo "Usage: $0 CHECKPOINT..." >&2
+  exit 1
+fi
+
+awk '
+  BEGIN { first = -1 }
+  FNR == 1 { good += $1; bad += $2; ugly += $3; n++ }
+  FNR == 2 && $2 > 0 && (first < 0 || $2 < first) { first = $2; time = $3 }
+  FNR == 3 {
+    if (n > 1 && $2 != seed) {
+      print FILENAME ": seed " $2 ", not " seed > "/dev/stderr"
+      error = 1
+    }
+    seed = $2
+    start[n] = $3; end[n] = $3 + $4; tests += $5 - $3; seconds += $6
+    if ($5 < $3 + $4)
+      print FILENAME ": unfinished, " $5 - $3 " tests of " $4 > "/dev/stderr"
+  }
+  END {
+    if (error)
+      exit 1
+    # Ranges in order (few shards: insertion sort)
+    for (i = 2; i <= n; i++)
+      for (j = i; j > 1 && start[j] < start[j - 1]; j--) {
+        t = start[j]; start[j] = start[j - 1]; start[j - 1] = t
+        t = end[j]; end[j] = end[j - 1]; end[j - 1] = t
+      }
+    for (i = 2; i <= n; i++)
+      if (start[i] > end[i - 1])
+        printf "tests %d to %d missing\n", end[i - 1] + 1, start[i] \
+          > "/dev/stderr"
+      else if (start[i] < end[i - 1])
+        printf "tests %d to %d in two shards\n", start[i] + 1, end[i - 1] \
+          > "/dev/stderr"
+    if (first < 0)
+      time = sprintf("%.6f", seconds)
+    printf "%d %d %d\nfirst %d %s\nshards %d %d %.6f\n", good, bad, ugly,
+           first, time, n, tests, seconds
+  }
+' "$@"
+
+# Indices from 1, as in the output of the shards
+failures=$(awk 'FNR == 4 { for (i = 3; i <= NF; i++) print $i }' "$@" \
+             | sort -n | uniq | head -n 100)
+echo "failures $(grep -c . <<< "$failures" || true)" $failures
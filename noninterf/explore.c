@@ -0,0 +1,1295 @@
+// Built-in concolic explorer for the abstract machine (make explore).
+//
+// Explores the same input space as the Klee harness: a valid machine 1 that
+// runs without error, and an indistinguishable machine 2. Inputs only
+// influence the control flow of step() through the opcodes, the initial sp,
+// tags, and a few comparisons on values (memory index and bounds, integer
+// overflow). Opcodes and tags are chosen lazily, when an instruction is
+// reached or a tag is compared. Values are linear combinations of the input
+// values, and the constraints on them are decided by a small interval solver.
+//
+// Indices stay symbolic: the initial sp is an interval, narrowed only when
+// an access could under- or overflow the stack, and memory cells are named
+// by the classes of the addresses accessed so far, so that a LOAD or STORE
+// branches on aliasing rather than on every address.
+//
+// A path is a sequence of choices, explored depth-first by re-execution.
+// Both machines run the same opcodes, in lockstep: the state after an
+// instruction determines the rest of the path, and a path that reaches a
+// state already explored is merged into it (not explored again). Worker
+// processes split the first choices (path prefixes) between them.
+// Every counterexample is replayed with the concrete step() before being
+// reported.
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "noninterf.c"
+
+#if defined(BUG_PUSH_OVERFLOW) || defined(BUG_POP_UNDERFLOW) \
+  || defined(BUG_LOAD_UNDERFLOW) || defined(BUG_LOAD_OOB) \
+  || defined(BUG_STORE_UNDERFLOW) || defined(BUG_STORE_OOB) \
+  || defined(BUG_ADD_UNDERFLOW) || defined(BUG_ADD_INT_OVERFLOW)
+#error "explore: memory safety bugs are undefined behavior and not modelled"
+#endif
+
+#ifdef CONTROL_FLOW
+#error "explore: control flow (jumps to values) is not modelled"
+#endif
+
+// Input atoms: initial stack, initial memory, immediates.
+#define A_STK 0
+#define A_MEM (A_STK + STK_LENGTH)
+#define A_IMM (A_MEM + MEM_LENGTH)
+#define NATOMS (A_IMM + PRG_LENGTH)
+
+// Value variables: atom a has value x[a] in machine 1, and x[NATOMS + a] in
+// machine 2, which is the same variable if the tag of a is L.
+#define NVARS (2 * NATOMS)
+
+#if NATOMS > 63
+#error "explore: too many input atoms"
+#endif
+
+#define MAX_DEPTH 1024
+#define MAX_CONSTRAINTS 256
+#define PREFIX_DEPTH 3
+#define SMALL_DOMAIN 64
+#define NODE_LIMIT 100000
+
+#define INF ((int64_t) 1 << 62)
+
+// c + sum k[v] * x[v]
+typedef struct {
+  int64_t c;
+  int64_t k[NVARS];
+} Expr;
+
+// Tags are joins of input tags, as a set of atoms.
+typedef uint64_t SymTag;
+
+typedef struct {
+  SymTag tag;
+  Expr value;
+} SymAtom;
+
+typedef struct {
+  int pc;
+  int sp;  // relative to the initial sp
+  SymAtom stack[2 * STK_LENGTH];  // see SLOT
+  SymAtom memory[MEM_LENGTH];     // by class of address
+} SymMachine;
+
+// Stack slot at p relative to the initial sp; p < 0 for the initial stack
+#define SLOT(m, p) (&(m)->stack[STK_LENGTH + (p)])
+
+// lo <= e <= hi
+typedef struct {
+  Expr e;
+  int64_t lo, hi;
+} Constraint;
+
+typedef struct {
+  int64_t lo[NVARS], hi[NVARS];
+} Box;
+
+typedef struct {
+  long paths;      // complete paths, machine 2 indistinguishable
+  long cex;        // counterexamples
+  long discarded;  // one of the machines errored
+  long pruned;     // infeasible choices
+  long unknown;    // solver gave up
+  long mismatch;   // concrete replay disagrees (bug in the explorer)
+  long merged;     // reached a state already explored
+  double first_cex;
+} Stats;
+
+// Current path
+static int trail[MAX_DEPTH];
+static uint64_t trail_mask[MAX_DEPTH];
+static int depth, trail_len;
+static jmp_buf path_end;
+
+static Constraint constraints[MAX_CONSTRAINTS];
+static int nconstraints;
+static SymTag assigned, high;
+static int opcodes[PRG_LENGTH];
+static SymMachine sym[2];
+
+// The initial sp, in [sp_lo, sp_hi]
+static int sp_lo, sp_hi;
+
+// Class c is the memory cell at address class_addr[c], with initial atom
+// A_MEM + c. Addresses of distinct classes differ: e != 0 for e in diseqs.
+#define MAX_DISEQS (MEM_LENGTH * (MEM_LENGTH - 1) / 2 + 1)
+static Expr class_addr[MEM_LENGTH];
+static int nclasses;
+static Expr diseqs[MAX_DISEQS];
+static int ndiseqs;
+
+// Exploration
+static int worker, jobs = 1, first_only, quiet;
+static Stats stats;
+static volatile sig_atomic_t interrupted;
+static struct timespec start;
+
+static double elapsed(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+enum PathEnd { END_PRUNED = 1, END_DONE };
+
+static void prune(void) {
+  stats.pruned++;
+  longjmp(path_end, END_PRUNED);
+}
+
+// Pick one of the alternatives in mask, in order over paths.
+static int choose_in(uint64_t mask) {
+  if (depth >= MAX_DEPTH) {
+    fprintf(stderr, "explore: path too deep\n");
+    exit(1);
+  }
+  if (depth < trail_len) {
+    depth++;
+  } else {
+    trail[depth] = __builtin_ctzll(mask);
+    trail_mask[depth] = mask;
+    trail_len = ++depth;
+  }
+  // Prefixes belong to one worker each
+  if (depth == PREFIX_DEPTH && jobs > 1) {
+    int id = 0;
+    for (int i = 0; i < PREFIX_DEPTH; i++)
+      id = id * 8 + trail[i];
+    if (id % jobs != worker)
+      longjmp(path_end, END_PRUNED);
+  }
+  return trail[depth-1];
+}
+
+static int choose(int n) {
+  return choose_in(n == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1);
+}
+
+// Whether the next choice is a new one, rather than replayed.
+static int fresh(void) {
+  return depth >= trail_len;
+}
+
+// Next path in depth-first order, 0 when done.
+static int backtrack(void) {
+  for (int d = trail_len - 1; d >= 0; d--) {
+    uint64_t next = trail_mask[d] & ~(((uint64_t) 2 << trail[d]) - 1);
+    if (next) {
+      trail[d] = __builtin_ctzll(next);
+      trail_len = d + 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Expressions */
+
+static Expr expr_const(int64_t c) {
+  Expr e;
+  memset(&e, 0, sizeof e);
+  e.c = c;
+  return e;
+}
+
+static Expr expr_var(int v) {
+  Expr e = expr_const(0);
+  e.k[v] = 1;
+  return e;
+}
+
+static Expr expr_add(const Expr *a, const Expr *b, int64_t sign) {
+  Expr e;
+  e.c = a->c + sign * b->c;
+  for (int v = 0; v < NVARS; v++)
+    e.k[v] = a->k[v] + sign * b->k[v];
+  return e;
+}
+
+static int expr_is_const(const Expr *e) {
+  for (int v = 0; v < NVARS; v++)
+    if (e->k[v])
+      return 0;
+  return 1;
+}
+
+// Variable standing for x[v] once tags are known.
+static int var_rep(int v) {
+  if (v >= NATOMS) {
+    SymTag a = (SymTag) 1 << (v - NATOMS);
+    if ((assigned & a) && !(high & a))
+      return v - NATOMS;
+  }
+  return v;
+}
+
+static Expr expr_rep(const Expr *e) {
+  Expr r = expr_const(e->c);
+  for (int v = 0; v < NVARS; v++)
+    r.k[var_rep(v)] += e->k[v];
+  return r;
+}
+
+/* Solver: bounds propagation, then branch on the domain of one variable. */
+
+// Rounded divisions by p > 0
+static int64_t floor_div(int64_t a, int64_t p) {
+  return a >= 0 ? a / p : -((-a + p - 1) / p);
+}
+
+static int64_t ceil_div(int64_t a, int64_t p) {
+  return a >= 0 ? (a + p - 1) / p : -(-a / p);
+}
+
+static int propagate(Box *b, const Constraint *cs, int n) {
+  for (int round = 0; round < 16; round++) {
+    int changed = 0;
+    for (int i = 0; i < n; i++) {
+      const Expr *e = &cs[i].e;
+      int64_t min = e->c, max = e->c;
+      for (int v = 0; v < NVARS; v++) {
+        int64_t k = e->k[v];
+        if (k > 0) {
+          min += k * b->lo[v];
+          max += k * b->hi[v];
+        } else if (k < 0) {
+          min += k * b->hi[v];
+          max += k * b->lo[v];
+        }
+      }
+      if (max < cs[i].lo || min > cs[i].hi)
+        return 0;
+      // New bounds are computed from min and max before being applied
+      int64_t nlo[NVARS], nhi[NVARS];
+      for (int v = 0; v < NVARS; v++) {
+        int64_t k = e->k[v];
+        nlo[v] = b->lo[v];
+        nhi[v] = b->hi[v];
+        if (k == 0)
+          continue;
+        // Bounds of k * x[v] given the rest of e
+        int64_t rmin = min - (k > 0 ? k * b->lo[v] : k * b->hi[v]);
+        int64_t rmax = max - (k > 0 ? k * b->hi[v] : k * b->lo[v]);
+        int64_t kmin = cs[i].lo - rmax, kmax = cs[i].hi - rmin;
+        if (k > 0) {
+          if (kmin > -INF / 2)
+            nlo[v] = ceil_div(kmin, k);
+          if (kmax < INF / 2)
+            nhi[v] = floor_div(kmax, k);
+        } else {
+          if (kmax < INF / 2)
+            nlo[v] = ceil_div(-kmax, -k);
+          if (kmin > -INF / 2)
+            nhi[v] = floor_div(-kmin, -k);
+        }
+      }
+      for (int v = 0; v < NVARS; v++) {
+        if (nlo[v] > b->lo[v]) {
+          b->lo[v] = nlo[v];
+          changed = 1;
+        }
+        if (nhi[v] < b->hi[v]) {
+          b->hi[v] = nhi[v];
+          changed = 1;
+        }
+        if (b->lo[v] > b->hi[v])
+          return 0;
+      }
+    }
+    if (!changed)
+      return 1;
+  }
+  return 1;
+}
+
+static long nodes;
+
+// Disequalities of the current solve, checked as soon as their variables
+// are fixed: at the leaves, the search would first try every value of the
+// variables fixed after them.
+static Expr ds[MAX_DISEQS];
+static int nds;
+
+static int diseqs_hold(const Box *b) {
+  for (int i = 0; i < nds; i++) {
+    int64_t x = ds[i].c;
+    int fixed = 1;
+    for (int v = 0; v < NVARS && fixed; v++) {
+      fixed = !ds[i].k[v] || b->lo[v] == b->hi[v];
+      x += ds[i].k[v] * b->lo[v];
+    }
+    if (fixed && x == 0)
+      return 0;
+  }
+  return 1;
+}
+
+// 1: model in b, 0: unsatisfiable, -1: unknown
+static int search(Box *b, const Constraint *cs, int n, uint64_t used) {
+  if (!propagate(b, cs, n) || !diseqs_hold(b))
+    return 0;
+  // Smallest domain first: the wide ones (values that only have to stay
+  // below INT_MAX) are fixed last, where their lowest values fit
+  int v = NVARS;
+  for (int u = 0; u < NVARS; u++)
+    if ((used >> u & 1) && b->lo[u] < b->hi[u]
+        && (v == NVARS || b->hi[u] - b->lo[u] < b->hi[v] - b->lo[v]))
+      v = u;
+  if (v == NVARS)
+    return 1;
+  if (++nodes > NODE_LIMIT)
+    return -1;
+  // Small domains: try the lowest value first, models stay readable.
+  // Wide ones (sums close to INT_MAX) are halved, fixing a single
+  // value there makes bounds propagation crawl.
+  int64_t lo = b->lo[v], hi = b->hi[v], mid = lo + (hi - lo) / 2;
+  int64_t split_lo[3] = {lo, lo + 1, mid + 1};
+  int64_t split_hi[3] = {lo, mid, hi};
+  int i0 = 0;
+  if (hi - lo > SMALL_DOMAIN) {
+    split_lo[1] = lo;
+    i0 = 1;
+  }
+  int r = 0;
+  for (int i = i0; i < 3; i++) {
+    if (split_lo[i] > split_hi[i])
+      continue;
+    Box c = *b;
+    c.lo[v] = split_lo[i];
+    c.hi[v] = split_hi[i];
+    int ri = search(&c, cs, n, used);
+    if (ri == 1) {
+      *b = c;
+      return 1;
+    }
+    if (ri < 0)
+      r = -1;
+  }
+  return r;
+}
+
+// x[v] = defs[v] for the variables eliminated by the current solve
+static int eliminated[NVARS];
+static Expr defs[NVARS];
+
+static void substitute(Expr *e, int v, const Expr *def) {
+  int64_t k = e->k[v];
+  if (!k)
+    return;
+  e->k[v] = 0;
+  e->c += k * def->c;
+  for (int u = 0; u < NVARS; u++)
+    e->k[u] += k * def->k[u];
+}
+
+// Eliminate a variable of coefficient 1 or -1 from each equality (most of
+// them: x - y == 0 for aliasing and low values), so that propagation sees
+// through chains of them. The equality becomes the bounds of the variable.
+static void eliminate(Constraint *cs, int n) {
+  memset(eliminated, 0, sizeof eliminated);
+  for (int i = 0; i < n; i++) {
+    if (cs[i].lo != cs[i].hi)
+      continue;
+    int v;
+    for (v = 0; v < NVARS; v++)
+      if (cs[i].e.k[v] == 1 || cs[i].e.k[v] == -1)
+        break;
+    if (v == NVARS)
+      continue;
+    // k x[v] + rest == lo, k = 1 or -1: x[v] = k (lo - rest)
+    int64_t k = cs[i].e.k[v];
+    Expr def = cs[i].e;
+    def.k[v] = 0;
+    def.c = k * (cs[i].lo - def.c);
+    for (int u = 0; u < NVARS; u++)
+      def.k[u] *= -k;
+    for (int j = 0; j < n; j++)
+      if (j != i)
+        substitute(&cs[j].e, v, &def);
+    for (int u = 0; u < NVARS; u++)
+      if (eliminated[u])
+        substitute(&defs[u], v, &def);
+    defs[v] = def;
+    eliminated[v] = 1;
+    cs[i].e = def;
+    cs[i].lo = 0;
+    cs[i].hi = INT_MAX;
+  }
+}
+
+// Substitute the variables fixed in b, and merge constraints on the same
+// expression into one interval: propagation alone takes too long to find
+// that e <= n and e > n conflict. Returns 0 if a conflict is found.
+static int simplify(Box *b, Constraint *cs, int *n, uint64_t *used) {
+  int m = 0;
+  *used = 0;
+  for (int i = 0; i < *n; i++) {
+    Constraint c = cs[i];
+    for (int v = 0; v < NVARS; v++) {
+      if (c.e.k[v] && b->lo[v] == b->hi[v]) {
+        c.e.c += c.e.k[v] * b->lo[v];
+        c.e.k[v] = 0;
+      }
+    }
+    if (c.lo > -INF / 2)
+      c.lo -= c.e.c;
+    if (c.hi < INF / 2)
+      c.hi -= c.e.c;
+    c.e.c = 0;
+    int j;
+    for (j = 0; j < m; j++)
+      if (!memcmp(cs[j].e.k, c.e.k, sizeof c.e.k))
+        break;
+    if (j == m) {
+      cs[m++] = c;
+    } else {
+      if (c.lo > cs[j].lo)
+        cs[j].lo = c.lo;
+      if (c.hi < cs[j].hi)
+        cs[j].hi = c.hi;
+    }
+    if (cs[j].lo > cs[j].hi)
+      return 0;
+    for (int v = 0; v < NVARS; v++)
+      if (c.e.k[v])
+        *used |= (uint64_t) 1 << v;
+  }
+  *n = m;
+  return 1;
+}
+
+// With full == 0, only propagate (the disequalities only narrow intervals):
+// unsatisfiable or unknown.
+static int solve(Box *model, int full) {
+  static Constraint cs[MAX_CONSTRAINTS];
+  int n = nconstraints;
+  uint64_t used;
+  for (int i = 0; i < n; i++) {
+    cs[i].e = expr_const(constraints[i].e.c);
+    cs[i].lo = constraints[i].lo;
+    cs[i].hi = constraints[i].hi;
+    for (int v = 0; v < NVARS; v++)
+      cs[i].e.k[var_rep(v)] += constraints[i].e.k[v];
+  }
+  for (int v = 0; v < NVARS; v++) {
+    model->lo[v] = 0;
+    model->hi[v] = INT_MAX;
+  }
+  eliminate(cs, n);
+  // Alternate simplification and propagation until no constraint goes away
+  if (!simplify(model, cs, &n, &used))
+    return 0;
+  for (;;) {
+    int before = n;
+    if (!propagate(model, cs, n) || !simplify(model, cs, &n, &used))
+      return 0;
+    if (n == before)
+      break;
+  }
+  // Disequalities: decided once constant, else they narrow the interval of
+  // the same expression (x - y == 0 and x - y != 0 take too long to search)
+  nds = 0;
+  for (int i = 0; i < ndiseqs; i++) {
+    Expr d = expr_rep(&diseqs[i]);
+    for (int v = 0; v < NVARS; v++)
+      if (eliminated[v])
+        substitute(&d, v, &defs[v]);
+    for (int v = 0; v < NVARS; v++) {
+      if (d.k[v] && model->lo[v] == model->hi[v]) {
+        d.c += d.k[v] * model->lo[v];
+        d.k[v] = 0;
+      }
+    }
+    if (expr_is_const(&d)) {
+      if (d.c == 0)
+        return 0;
+      continue;
+    }
+    for (int j = 0; j < n; j++) {
+      int same = 1, neg = 1;
+      for (int v = 0; v < NVARS; v++) {
+        same &= cs[j].e.k[v] == d.k[v];
+        neg &= cs[j].e.k[v] == -d.k[v];
+      }
+      if (!same && !neg)
+        continue;
+      int64_t t = same ? -d.c : d.c;
+      if (cs[j].lo == t)
+        cs[j].lo++;
+      if (cs[j].hi == t)
+        cs[j].hi--;
+      if (cs[j].lo > cs[j].hi)
+        return 0;
+    }
+    ds[nds++] = d;
+  }
+  if (nds && !propagate(model, cs, n))
+    return 0;
+  if (!full)
+    return -1;
+  for (int i = 0; i < nds; i++)
+    for (int v = 0; v < NVARS; v++)
+      if (ds[i].k[v])
+        used |= (uint64_t) 1 << v;
+  nodes = 0;
+  int r = search(model, cs, n, used);
+  for (int v = 0; r == 1 && v < NVARS; v++) {
+    if (!eliminated[v])
+      continue;
+    int64_t x = defs[v].c;
+    for (int u = 0; u < NVARS; u++)
+      x += defs[v].k[u] * model->lo[u];
+    model->lo[v] = model->hi[v] = x;
+  }
+  return r;
+}
+
+static int feasible(void) {
+  Box b;
+  // Propagation is enough to prune most choices; the rest are pruned when
+  // the path is finished
+  return solve(&b, 0) != 0;
+}
+
+static void constrain(const Expr *e, int64_t lo, int64_t hi) {
+  if (nconstraints == MAX_CONSTRAINTS) {
+    fprintf(stderr, "explore: too many constraints\n");
+    exit(1);
+  }
+  constraints[nconstraints].e = *e;
+  constraints[nconstraints].lo = lo;
+  constraints[nconstraints].hi = hi;
+  nconstraints++;
+}
+
+/* Tags */
+
+static Tag tag_of(SymTag t) {
+  for (;;) {
+    if (t & assigned & high)
+      return H;
+    SymTag unknown = t & ~assigned;
+    if (!unknown)
+      return L;
+    SymTag a = unknown & -unknown;
+    assigned |= a;
+    // L unifies the values of a in both machines, which may be infeasible
+    uint64_t mask = 2;
+    if (fresh() && feasible())
+      mask |= 1;
+    if (choose_in(mask))
+      high |= a;
+  }
+}
+
+// Decide the tags of the atoms whose value in machine 2 appears in e.
+static void resolve_tags(const Expr *e) {
+  for (int a = 0; a < NATOMS; a++)
+    if (e->k[NATOMS + a])
+      tag_of((SymTag) 1 << a);
+}
+
+// Branch on the interval that e falls in among n alternatives.
+static int branch(const Expr *e, int n, const int64_t lo[], const int64_t hi[]) {
+  resolve_tags(e);
+  if (expr_is_const(e)) {
+    for (int i = 0; i < n; i++)
+      if (lo[i] <= e->c && e->c <= hi[i])
+        return i;
+    prune();
+  }
+  uint64_t mask = 0;
+  if (fresh()) {
+    for (int i = 0; i < n; i++) {
+      constrain(e, lo[i], hi[i]);
+      if (feasible())
+        mask |= (uint64_t) 1 << i;
+      nconstraints--;
+    }
+    if (!mask)
+      prune();
+  }
+  int i = choose_in(mask);
+  constrain(e, lo[i], hi[i]);
+  return i;
+}
+
+// Whether two atoms are indistinguishable whatever the tags still unknown:
+// they have the same tag, and the same value if that tag is L.
+static int same_if_low(const SymAtom *a1, const SymAtom *a2) {
+  if (a1->tag != a2->tag)
+    return 0;
+  SymTag low = a1->tag | (assigned & ~high);
+  if (a1->tag & assigned & high)
+    return 1;
+  int64_t k[NVARS];
+  memset(k, 0, sizeof k);
+  for (int v = 0; v < NVARS; v++) {
+    int r = v >= NATOMS && (low >> (v - NATOMS) & 1) ? v - NATOMS : v;
+    k[r] += a1->value.k[v] - a2->value.k[v];
+  }
+  if (a1->value.c != a2->value.c)
+    return 0;
+  for (int v = 0; v < NVARS; v++)
+    if (k[v])
+      return 0;
+  return 1;
+}
+
+/* Machines */
+
+static SymAtom input_atom(int a, int side) {
+  SymAtom atom;
+  atom.tag = (SymTag) 1 << a;
+  atom.value = expr_var(side == 1 ? a : NATOMS + a);
+  return atom;
+}
+
+// Slot -1 - k holds the atom k from the top of the initial stack (if the
+// initial sp is above k). Memory cells are set up with their class.
+static void init_machine(SymMachine *m, int side) {
+  m->pc = 0;
+  m->sp = 0;
+  for (int k = 0; k < STK_LENGTH; k++)
+    *SLOT(m, -1 - k) = input_atom(A_STK + k, side);
+}
+
+static SymAtom initial_cell(int c, int side) {
+#ifdef ZERO_MEMORY
+  SymAtom atom;
+  (void) c;
+  (void) side;
+  atom.tag = 0;
+  atom.value = expr_const(0);
+  return atom;
+#else
+  return input_atom(A_MEM + c, side);
+#endif
+}
+
+static int opcode_at(int pc) {
+  if (opcodes[pc] < 0)
+    opcodes[pc] = choose(HALT + 1);
+  return opcodes[pc];
+}
+
+// Whether the initial sp is at least n, narrowing its interval.
+static int sp_at_least(int n) {
+  if (sp_lo >= n)
+    return 1;
+  if (sp_hi < n)
+    return 0;
+  if (choose(2)) {
+    sp_hi = n - 1;
+    return 0;
+  }
+  sp_lo = n;
+  return 1;
+}
+
+// Class of the memory cell at address e: one of the classes so far, a new
+// one (nclasses) or -1 if out of bounds.
+static int mem_class(const Expr *e) {
+  Expr diff[MEM_LENGTH];
+  resolve_tags(e);
+  int n = nclasses, is_new = n < MEM_LENGTH;
+  for (int c = 0; c < n; c++) {
+    Expr d = expr_add(e, &class_addr[c], -1);
+    diff[c] = expr_rep(&d);
+    if (expr_is_const(&diff[c]) && diff[c].c == 0)
+      is_new = 0;
+  }
+  // 0 to n - 1: class c, n: new, n + 1: out of bounds
+  uint64_t mask = 0;
+  if (fresh()) {
+    for (int c = 0; c <= n + 1; c++) {
+      if (c == n && !is_new)
+        continue;
+      if (c < n)
+        constrain(&diff[c], 0, 0);
+      else
+        constrain(e, c == n ? 0 : MEM_LENGTH, c == n ? MEM_LENGTH - 1 : INF);
+      if (feasible())
+        mask |= (uint64_t) 1 << c;
+      nconstraints--;
+    }
+    if (!mask)
+      prune();
+  }
+  int c = choose_in(mask);
+  if (c < n) {
+    constrain(&diff[c], 0, 0);
+    return c;
+  }
+  if (c > n) {
+    constrain(e, MEM_LENGTH, INF);
+    return -1;
+  }
+  constrain(e, 0, MEM_LENGTH - 1);
+  for (int d = 0; d < n; d++)
+    if (!expr_is_const(&diff[d]))
+      diseqs[ndiseqs++] = diff[d];
+  class_addr[n] = *e;
+  sym[0].memory[n] = initial_cell(n, 1);
+  sym[1].memory[n] = initial_cell(n, 2);
+  nclasses++;
+  return n;
+}
+
+static int overflows(const Expr *sum) {
+  static const int64_t lo[2] = {-INF, (int64_t) INT_MAX + 1};
+  static const int64_t hi[2] = {INT_MAX, INF};
+  return branch(sum, 2, lo, hi);
+}
+
+static Outcome sym_step(SymMachine *m, int side) {
+  if (m->pc >= PRG_LENGTH)
+    return EXITED;
+
+  SymAtom *addr, data;
+  int i;
+
+  switch (opcode_at(m->pc)) {
+    case NOOP:
+      break;
+    case PUSH:
+      if (sp_at_least(STK_LENGTH - m->sp))
+        return ERRORED;
+      *SLOT(m, m->sp++) = input_atom(A_IMM + m->pc, side);
+      break;
+    case POP:
+      if (!sp_at_least(1 - m->sp))
+        return ERRORED;
+      m->sp--;
+      break;
+    case LOAD:
+      if (!sp_at_least(1 - m->sp))
+        return ERRORED;
+      addr = SLOT(m, m->sp-1);
+      i = mem_class(&addr->value);
+      if (i < 0)
+        return ERRORED;
+#ifdef BUG_LOAD_TAG
+      *addr = m->memory[i];
+#else
+      SymTag t = addr->tag;
+      *addr = m->memory[i];
+      addr->tag |= t;
+#endif
+      break;
+    case STORE:
+      if (!sp_at_least(2 - m->sp))
+        return ERRORED;
+      addr = SLOT(m, m->sp-1);
+      data = *SLOT(m, m->sp-2);
+      i = mem_class(&addr->value);
+      if (i < 0)
+        return ERRORED;
+#ifndef BUG_STORE_TAG
+      data.tag |= addr->tag;
+#endif
+#ifndef BUG_STORE_TAG_2
+      if (tag_of(addr->tag) == H && tag_of(m->memory[i].tag) == L)
+        return ERRORED;
+#endif
+      m->memory[i] = data;
+      m->sp -= 2;
+      break;
+    case ADD:
+      if (!sp_at_least(2 - m->sp))
+        return ERRORED;
+      data.value = expr_add(&SLOT(m, m->sp-1)->value, &SLOT(m, m->sp-2)->value, 1);
+      if (overflows(&data.value))
+        return ERRORED;
+#ifdef BUG_ADD_TAG
+      data.tag = 0;
+#else
+      data.tag = SLOT(m, m->sp-1)->tag | SLOT(m, m->sp-2)->tag;
+#endif
+      *SLOT(m, m->sp-2) = data;
+      m->sp--;
+      break;
+    case HALT:
+      return HALTED;
+  }
+
+  m->pc++;
+  return STEPPED;
+}
+
+/* Concrete replay */
+
+static void print_cex(Machine *m1_, Machine *m2_, Machine *m1, Machine *m2) {
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  FILE *saved = stdout;
+  stdout = out;
+  printf("*** Counterexample (%.3fs)\n*** Initial\n", elapsed());
+  print_machine_pair(m1_, m2_);
+  printf("*** Final\n");
+  print_machine_pair(m1, m2);
+  stdout = saved;
+  fclose(out);
+  fwrite(buf, 1, len, stdout);
+  fflush(stdout);
+  free(buf);
+}
+
+// Build concrete machines from a model of the current path and run them.
+// Returns whether their final states are indistinguishable.
+static int replay(const Box *model, int print) {
+  Machine machine1, machine1_, machine2, machine2_;
+  MemAtom
+    memory1[MEM_LENGTH], memory1_[MEM_LENGTH],
+    memory2[MEM_LENGTH], memory2_[MEM_LENGTH];
+  StkAtom
+    stack1[STK_LENGTH], stack1_[STK_LENGTH],
+    stack2[STK_LENGTH], stack2_[STK_LENGTH];
+  Insn insns1[PRG_LENGTH], insns2[PRG_LENGTH];
+  Atom atoms1[NATOMS], atoms2[NATOMS];
+
+  for (int a = 0; a < NATOMS; a++) {
+    SymTag bit = (SymTag) 1 << a;
+    atoms1[a].tag = atoms2[a].tag = (assigned & high & bit) ? H : L;
+    atoms1[a].value = model->lo[a];
+    // Tags that are still unknown do not matter: take them as L
+    atoms2[a].value = atoms1[a].tag == H ? model->lo[NATOMS + a] : atoms1[a].value;
+  }
+
+  machine1.pc = machine2.pc = 0;
+  machine1.sp = machine2.sp = sp_lo;
+  machine1.memory = memory1;
+  machine1.stack = stack1;
+  machine1.insns = insns1;
+  machine2.memory = memory2;
+  machine2.stack = stack2;
+  machine2.insns = insns2;
+  for (int i = 0; i < sp_lo; i++) {
+    stack1[i] = atoms1[A_STK + sp_lo - 1 - i];
+    stack2[i] = atoms2[A_STK + sp_lo - 1 - i];
+  }
+  // The cells of the classes at their addresses; the others are accessed
+  // by neither machine
+  const Atom zero = {L, 0};
+  for (int i = 0; i < MEM_LENGTH; i++)
+    memory1[i] = memory2[i] = zero;
+#ifndef ZERO_MEMORY
+  for (int c = 0; c < nclasses; c++) {
+    int64_t a = class_addr[c].c;
+    for (int v = 0; v < NVARS; v++)
+      a += class_addr[c].k[v]
+        * (v < NATOMS ? atoms1[v].value : atoms2[v - NATOMS].value);
+    if (a < 0 || a >= MEM_LENGTH)
+      return -1;
+    memory1[a] = atoms1[A_MEM + c];
+    memory2[a] = atoms2[A_MEM + c];
+  }
+#endif
+  for (int i = 0; i < PRG_LENGTH; i++) {
+    // Instructions that are never reached do not matter
+    insns1[i].t = insns2[i].t = opcodes[i] < 0 ? NOOP : (InsnType) opcodes[i];
+    insns1[i].immediate = atoms1[A_IMM + i];
+    insns2[i].immediate = atoms2[A_IMM + i];
+  }
+
+  machine1_.memory = memory1_;
+  machine1_.stack = stack1_;
+  machine1_.insns = insns1;
+  copy_machine(&machine1, &machine1_);
+  machine2_.memory = memory2_;
+  machine2_.stack = stack2_;
+  machine2_.insns = insns2;
+  copy_machine(&machine2, &machine2_);
+
+  if (run(&machine1) == ERRORED || run(&machine2) == ERRORED)
+    return -1;
+  int indist = indist_machine(&machine1, &machine2);
+  if (!indist && print)
+    print_cex(&machine1_, &machine2_, &machine1, &machine2);
+  return indist;
+}
+
+/* Paths */
+
+// Decide the remaining tags that machine 2 depends on, then solve and replay.
+static void finish(int expect_indist) {
+  // Paths shorter than a prefix are explored by every worker, and belong
+  // to worker 0
+  if (depth < PREFIX_DEPTH && worker != 0)
+    longjmp(path_end, END_PRUNED);
+  for (int i = 0; i < nconstraints; i++)
+    resolve_tags(&constraints[i].e);
+  for (int i = 0; i < ndiseqs; i++)
+    resolve_tags(&diseqs[i]);
+  Box model;
+  switch (solve(&model, 1)) {
+    case 0:
+      prune();
+    case -1:
+      stats.unknown++;
+      longjmp(path_end, END_DONE);
+  }
+  int indist = replay(&model, !expect_indist && !quiet);
+  if (indist != expect_indist) {
+    stats.mismatch++;
+    fprintf(stderr, "explore: concrete replay disagrees on path");
+    for (int d = 0; d < trail_len; d++)
+      fprintf(stderr, " %d", trail[d]);
+    fprintf(stderr, "\n");
+  } else if (expect_indist) {
+    stats.paths++;
+  } else {
+    if (stats.cex++ == 0)
+      stats.first_cex = elapsed();
+  }
+  longjmp(path_end, END_DONE);
+}
+
+/* Merging */
+
+// Two 64-bit hashes of the states explored, in an open addressing table
+typedef struct {
+  uint64_t h1, h2;
+} StateHash;
+
+static StateHash *seen;
+static size_t seen_size, seen_count;
+static uint64_t h1, h2;
+static int renamed[NATOMS], nrenamed;
+
+static void put(int64_t x) {
+  h1 = (h1 ^ (uint64_t) x) * 0x100000001b3ULL;
+  h2 = (h2 + (uint64_t) x) * 0xbf58476d1ce4e5b9ULL;
+  h2 ^= h2 >> 31;
+}
+
+// Atoms are renamed in order of appearance, with their tag when first seen:
+// states that only differ by the atoms they hold (say, the immediates of
+// NOOP; PUSH and PUSH; NOOP) are the same.
+static void put_atom(int a) {
+  if (renamed[a] < 0) {
+    SymTag bit = (SymTag) 1 << a;
+    renamed[a] = nrenamed++;
+    put(-1);
+    put(!(assigned & bit) ? 0 : (high & bit) ? 2 : 1);
+  }
+  put(renamed[a]);
+}
+
+static void put_expr(const Expr *e) {
+  put(e->c);
+  for (int v = 0; v < NVARS; v++) {
+    if (e->k[v]) {
+      put_atom(v % NATOMS);
+      put(v / NATOMS);
+      put(e->k[v]);
+    }
+  }
+  put(-2);
+}
+
+static void put_sym_atom(const SymAtom *a) {
+  for (SymTag t = a->tag; t; t &= t - 1)
+    put_atom(__builtin_ctzll(t));
+  put(-2);
+  put_expr(&a->value);
+}
+
+// 1 if the hash of the current state was there already, else add it
+static int seen_add(void) {
+  if (2 * seen_count >= seen_size) {
+    StateHash *old = seen;
+    size_t old_size = seen_size;
+    seen_size = seen_size ? 2 * seen_size : 1 << 16;
+    seen = calloc(seen_size, sizeof *seen);
+    if (!seen) {
+      perror("calloc");
+      exit(1);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+      if (!old[i].h1)
+        continue;
+      size_t j = old[i].h1 & (seen_size - 1);
+      while (seen[j].h1)
+        j = (j + 1) & (seen_size - 1);
+      seen[j] = old[i];
+    }
+    free(old);
+  }
+  uint64_t k1 = h1 | 1;
+  size_t j = k1 & (seen_size - 1);
+  for (; seen[j].h1; j = (j + 1) & (seen_size - 1))
+    if (seen[j].h1 == k1 && seen[j].h2 == h2)
+      return 1;
+  seen[j].h1 = k1;
+  seen[j].h2 = h2;
+  seen_count++;
+  return 0;
+}
+
+// Prune the path if it reaches, for the first time on this path, a state
+// where an earlier path was: the rest of the paths from there were explored
+// then. The state is that of both machines before an instruction (or at
+// the end, once they stopped), with the constraints and the tags decided.
+// With workers, only the states past the prefixes are merged: all of their
+// paths belong to one worker.
+static void merge(int ended) {
+  if (!fresh() || (jobs > 1 && depth < PREFIX_DEPTH))
+    return;
+  h1 = 0xcbf29ce484222325ULL;
+  h2 = 0;
+  memset(renamed, -1, sizeof renamed);
+  nrenamed = 0;
+  put(ended);
+  put(sym[0].pc);
+  put(sym[0].sp);
+  put(sp_lo);
+  put(sp_hi);
+  put(nclasses);
+  for (int s = 0; s < 2; s++) {
+    for (int p = -sp_hi; p < sym[s].sp; p++)
+      put_sym_atom(SLOT(&sym[s], p));
+    for (int c = 0; c < nclasses; c++)
+      put_sym_atom(&sym[s].memory[c]);
+  }
+  for (int c = 0; c < nclasses; c++)
+    put_expr(&class_addr[c]);
+  put(nconstraints);
+  for (int i = 0; i < nconstraints; i++) {
+    put_expr(&constraints[i].e);
+    put(constraints[i].lo);
+    put(constraints[i].hi);
+  }
+  put(ndiseqs);
+  for (int i = 0; i < ndiseqs; i++)
+    put_expr(&diseqs[i]);
+  if (seen_add()) {
+    stats.merged++;
+    longjmp(path_end, END_PRUNED);
+  }
+}
+
+static void path(void) {
+  SymMachine *m1 = &sym[0], *m2 = &sym[1];
+
+  nconstraints = ndiseqs = nclasses = 0;
+  assigned = high = 0;
+  for (int i = 0; i < PRG_LENGTH; i++)
+    opcodes[i] = -1;
+  sp_lo = 0;
+#ifdef EMPTY_STACK
+  sp_hi = 0;
+#else
+  sp_hi = STK_LENGTH - 1;
+#endif
+
+  init_machine(m1, 1);
+  init_machine(m2, 2);
+  Outcome o;
+  do {
+    merge(0);
+    o = sym_step(m1, 1);
+    if (o != ERRORED && sym_step(m2, 2) == ERRORED)
+      o = ERRORED;
+    if (o == ERRORED) {
+      stats.discarded++;
+      longjmp(path_end, END_DONE);
+    }
+  } while (o == STEPPED);
+  merge(1);
+
+  // Either the first distinguishable memory cell, or none. Cells of no
+  // class are accessed by neither machine, and stay indistinguishable.
+  uint64_t candidates = (uint64_t) 1 << nclasses;
+  for (int i = 0; i < nclasses; i++)
+    if (!same_if_low(&m1->memory[i], &m2->memory[i]))
+      candidates |= (uint64_t) 1 << i;
+  int j = choose_in(candidates);
+  for (int i = 0; i < nclasses && i <= j; i++) {
+    SymAtom *a1 = &m1->memory[i], *a2 = &m2->memory[i];
+    if (!(candidates >> i & 1))
+      continue;
+    Tag t1 = tag_of(a1->tag), t2 = tag_of(a2->tag);
+    Expr diff = expr_add(&a1->value, &a2->value, -1);
+    if (i < j) {
+      static const int64_t zero[1] = {0};
+      if (t1 != t2)
+        prune();
+      if (t1 == L)
+        branch(&diff, 1, zero, zero);
+    } else if (t1 == t2) {
+      static const int64_t lo[2] = {-INF, 1}, hi[2] = {-1, INF};
+      if (t1 == H)
+        prune();
+      branch(&diff, 2, lo, hi);
+    }
+  }
+  finish(j == nclasses);
+}
+
+static void explore(void) {
+  trail_len = 0;
+  do {
+    Stats before = stats;
+    depth = 0;
+    if (!setjmp(path_end))
+      path();
+    // Paths shorter than a prefix are explored by every worker (see finish)
+    if (trail_len < PREFIX_DEPTH && worker != 0)
+      stats = before;
+    if (interrupted || (first_only && stats.cex))
+      break;
+  } while (backtrack());
+}
+
+static void add_stats(Stats *total, const Stats *s) {
+  if (s->cex && (!total->cex || s->first_cex < total->first_cex))
+    total->first_cex = s->first_cex;
+  total->paths += s->paths;
+  total->cex += s->cex;
+  total->discarded += s->discarded;
+  total->pruned += s->pruned;
+  total->unknown += s->unknown;
+  total->mismatch += s->mismatch;
+  total->merged += s->merged;
+}
+
+// Set by SIGINT and SIGTERM: stop after the current path, and print the
+// statistics so far
+static void on_signal(int sig) {
+  (void) sig;
+  interrupted = 1;
+}
+
+static void usage(char *name) {
+  fprintf(stderr, "Usage: %s [-j JOBS] [-f] [-q]\n", name);
+  fprintf(stderr, "  -j JOBS  number of worker processes (default: 1)\n");
+  fprintf(stderr, "  -f       stop at the first counterexample\n");
+  fprintf(stderr, "  -q       do not print counterexamples\n");
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "j:fq")) != -1) {
+    switch (opt) {
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 'f':
+        first_only = 1;
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (jobs < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fflush(stdout);
+
+  // Without SA_RESTART, so that the read of the statistics below returns
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int fds[2];
+  if (pipe(fds)) {
+    perror("pipe");
+    return 1;
+  }
+  pid_t pids[jobs];
+  int forked = 0;
+  for (worker = 0; worker < jobs; worker++) {
+    pids[worker] = fork();
+    if (pids[worker] == 0) {
+      close(fds[0]);
+      explore();
+      if (write(fds[1], &stats, sizeof stats) != sizeof stats)
+        return 1;
+      return 0;
+    }
+    if (pids[worker] < 0)
+      perror("fork");
+    else
+      forked++;
+  }
+  close(fds[1]);
+
+  // The shares of the workers that could not be forked, here, once every
+  // worker has its copy of the initial state
+  Stats total;
+  memset(&total, 0, sizeof total);
+  for (worker = 0; worker < jobs && !interrupted && !(first_only && total.cex);
+       worker++) {
+    if (pids[worker] >= 0)
+      continue;
+    fprintf(stderr, "explore: worker %d runs in the main process\n", worker);
+    memset(&stats, 0, sizeof stats);
+    explore();
+    add_stats(&total, &stats);
+  }
+
+  Stats s;
+  int done = 0, forwarded = 0;
+  while (done < forked && !(first_only && total.cex)) {
+    ssize_t r = read(fds[0], &s, sizeof s);
+    if (r < 0 && errno == EINTR) {
+      // The workers send what they explored so far
+      for (int w = 0; w < jobs && !forwarded; w++)
+        if (pids[w] > 0)
+          kill(pids[w], SIGINT);
+      forwarded = 1;
+      continue;
+    }
+    if (r != sizeof s)
+      break;
+    done++;
+    add_stats(&total, &s);
+  }
+  if (first_only && total.cex)
+    for (int w = 0; w < jobs; w++)
+      if (pids[w] > 0)
+        kill(pids[w], SIGTERM);
+  while (wait(NULL) > 0)
+    ;
+
+  printf("paths %ld cex %ld discarded %ld pruned %ld unknown %ld merged %ld"
+      " time %.3f", total.paths, total.cex, total.discarded, total.pruned,
+      total.unknown, total.merged, elapsed());
+  if (total.cex)
+    printf(" first %.3f", total.first_cex);
+  if (interrupted)
+    printf(" interrupted");
+  printf("\n");
+  if (total.mismatch) {
+    fprintf(stderr, "explore: %ld paths disagree with the concrete machine\n",
+        total.mismatch);
+    return 2;
+  }
+  return interrupted ? 3 : 0;
+}
@@ -1,13 +1,19 @@
-#ifndef RANDOM
+#if !defined(RANDOM) && !defined(EXPLORE) && !defined(FUZZ)
 #include <klee/klee.h>
 #endif
 #include <limits.h>
 #include <stdlib.h>
 
-#if defined(REPLAY) || defined(RANDOM)
+#if defined(REPLAY) || defined(RANDOM) || defined(EXPLORE) || defined(FUZZ)
 #include <stdio.h>
 #endif
 
+#ifdef RANDOM
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 #ifndef MEM_LENGTH
 #define MEM_LENGTH 5
 #endif
@@ -18,6 +24,16 @@
 #define PRG_LENGTH 4
 #endif
 
+#ifdef CONTROL_FLOW
+// Loops are cut after STEP_BUDGET steps, and the test discarded
+#ifndef STEP_BUDGET
+#define STEP_BUDGET (4 * PRG_LENGTH)
+#endif
+#define MAX_FRAMES STK_LENGTH // depth of calls
+#define MAX_ARGS 2            // immediate of CALL: number of arguments
+#define BNZ_RANGE 4           // immediate of BNZ: offset, at most this far
+#endif
+
 enum Tag { L, H };
 typedef enum Tag Tag;
 
@@ -40,6 +56,13 @@ enum InsnType {
   STORE,
   ADD,
   HALT,
+#ifdef CONTROL_FLOW
+  JUMP,
+  BNZ,
+  CALL,
+  RETURN,
+#endif
+  INSN_TYPES, // number of opcodes
 };
 typedef enum InsnType InsnType;
 
@@ -58,16 +81,48 @@ typedef struct Insn Insn;
 typedef Atom MemAtom;
 typedef Atom StkAtom;
 
+#ifdef CONTROL_FLOW
+// Call: where and with which pc tag to return, and the bottom of the stack
+// of the callee (its arguments)
+struct Frame {
+  int pc;
+  Tag tag;
+  int sp;
+};
+typedef struct Frame Frame;
+#endif
+
+#if defined(MEMO_CACHE) && defined(RANDOM)
+// Locations of a machine, bits of a set: memory cells, then stack slots
+#define LOCATIONS (MEM_LENGTH + STK_LENGTH)
+#define LOC_WORDS ((LOCATIONS + 63) / 64)
+typedef struct {
+  unsigned long long w[LOC_WORDS];
+} LocSet;
+#define HAS_LOC(s, loc) ((s).w[(loc) / 64] >> (loc) % 64 & 1)
+#define ADD_LOC(s, loc) ((s).w[(loc) / 64] |= 1ULL << (loc) % 64)
+#endif
+
 struct Machine {
   int pc;  // program counter
   int sp;  // stack pointer
   MemAtom *memory;
   StkAtom *stack;
   Insn *insns;
+#ifdef CONTROL_FLOW
+  Tag pc_tag;
+  int fp;  // number of frames
+  Frame frames[MAX_FRAMES];
+#endif
+#if defined(MEMO_CACHE) && defined(RANDOM)
+  LocSet reads;   // initial locations read (see READ)
+  LocSet writes;  // locations written
+  int oob;        // a location out of bounds
+#endif
 };
 typedef struct Machine Machine;
 
-#if defined(REPLAY) || defined(RANDOM)
+#if defined(REPLAY) || defined(RANDOM) || defined(EXPLORE) || defined(FUZZ)
 void print_int_pair(int x, int y) {
   if (x == y) {
     printf("%d", x);
@@ -109,6 +164,16 @@ const char *insn_type(InsnType it) {
       return "ADD";
     case HALT:
       return "HALT";
+#ifdef CONTROL_FLOW
+    case JUMP:
+      return "JUMP";
+    case BNZ:
+      return "BNZ";
+    case CALL:
+      return "CALL";
+    case RETURN:
+      return "RETURN";
+#endif
     default:
       return "UNK";
   }
@@ -125,6 +190,12 @@ void print_insn(Insn i) {
     print_atom(i.immediate);
     printf(")");
   }
+#ifdef CONTROL_FLOW
+  // Untagged, the same in both machines
+  if (i.t == BNZ || i.t == CALL) {
+    printf("(%d)", i.immediate.value);
+  }
+#endif
 }
 
 void print_insn_pair(Insn i, Insn j) {
@@ -135,6 +206,13 @@ void print_insn_pair(Insn i, Insn j) {
       print_atom_pair(i.immediate, j.immediate);
       printf(")");
     }
+#ifdef CONTROL_FLOW
+    if (i.t == BNZ || i.t == CALL) {
+      printf("(");
+      print_int_pair(i.immediate.value, j.immediate.value);
+      printf(")");
+    }
+#endif
   } else {
     printf("[");
     print_insn(i);
@@ -147,8 +225,15 @@ void print_insn_pair(Insn i, Insn j) {
 void print_machine_pair(Machine *m1, Machine *m2) {
   printf("PC: ");
   print_int_pair(m1->pc, m2->pc);
+#ifdef CONTROL_FLOW
+  print_tag_pair(m1->pc_tag, m2->pc_tag);
+#endif
   printf("\tSP: ");
   print_int_pair(m1->sp, m2->sp);
+#ifdef CONTROL_FLOW
+  printf("\tFRAMES: ");
+  print_int_pair(m1->fp, m2->fp);
+#endif
   printf("\nSTK: ");
   int max_sp = m1->sp < m2->sp ? m2->sp : m1->sp;
   for (int i = 0; i < max_sp; i++) {
@@ -207,6 +292,20 @@ void print_machine_insns(Machine *m) {
       case NOOP:
         c = 'O';
         break;
+#ifdef CONTROL_FLOW
+      case JUMP:
+        c = 'J';
+        break;
+      case BNZ:
+        c = 'B';
+        break;
+      case CALL:
+        c = 'C';
+        break;
+      case RETURN:
+        c = 'R';
+        break;
+#endif
       default:
         c = 'U';
         halt = 1;
@@ -226,11 +325,54 @@ enum Outcome {
 };
 typedef enum Outcome Outcome;
 
+#if defined(MEMO_CACHE) && defined(RANDOM)
+// Out of bounds (bugs of the machine), location -1: the run is not cached
+#define MEM_LOC(i) ((unsigned) (i) < MEM_LENGTH ? (int) (i) : -1)
+#define STK_LOC(i) ((unsigned) (i) < STK_LENGTH ? MEM_LENGTH + (int) (i) : -1)
+
+// A location read before the run wrote it holds its initial value
+static inline void READ(Machine *m, int loc) {
+  if (loc < 0)
+    m->oob = 1;
+  else if (!HAS_LOC(m->writes, loc))
+    ADD_LOC(m->reads, loc);
+}
+
+static inline void WRITE(Machine *m, int loc) {
+  if (loc < 0)
+    m->oob = 1;
+  else
+    ADD_LOC(m->writes, loc);
+}
+#else
+#define READ(m, loc)
+#define WRITE(m, loc)
+#endif
+
+#ifdef CONTROL_FLOW
+// Bottom of the stack of the current function: it only sees its arguments
+#define BASE(m) ((m)->fp ? (m)->frames[(m)->fp - 1].sp : 0)
+#else
+#define BASE(m) 0
+#endif
+
+#if defined(CONTROL_FLOW) && defined(RANDOM)
+// Random programs are drawn as they run (see draw_insn)
+void draw_insn(int pc);
+#define FETCH(m) (draw_insn((m)->pc), (m)->insns[(m)->pc])
+#else
+#define FETCH(m) ((m)->insns[(m)->pc])
+#endif
+
 Outcome step(Machine *machine) {
   if (machine->pc >= PRG_LENGTH)
     return EXITED;
+#ifdef CONTROL_FLOW
+  if (machine->pc < 0)
+    return ERRORED;
+#endif
 
-  Insn current_insn = machine->insns[machine->pc];
+  Insn current_insn = FETCH(machine);
 
   switch (current_insn.t) {
     case NOOP:
@@ -241,11 +383,12 @@ Outcome step(Machine *machine) {
         return ERRORED;
       }
 #endif
+      WRITE(machine, STK_LOC(machine->sp));
       machine->stack[machine->sp++] = current_insn.immediate;
       break;
     case POP:
 #ifndef BUG_POP_UNDERFLOW
-      if (machine->sp < 1) {
+      if (machine->sp < BASE(machine) + 1) {
         return ERRORED;
       }
 #endif
@@ -253,11 +396,12 @@ Outcome step(Machine *machine) {
       break;
     case LOAD:
 #ifndef BUG_LOAD_UNDERFLOW
-      if (machine->sp < 1) {
+      if (machine->sp < BASE(machine) + 1) {
         return ERRORED;
       }
 #endif
       Atom *addr = &machine->stack[machine->sp-1];
+      READ(machine, STK_LOC(machine->sp-1));
 #ifndef BUG_LOAD_TAG
       Tag t = addr->tag;
 #endif
@@ -266,6 +410,8 @@ Outcome step(Machine *machine) {
         return ERRORED;
       }
 #endif
+      READ(machine, MEM_LOC(addr->value));
+      WRITE(machine, STK_LOC(machine->sp-1));
       *addr = machine->memory[addr->value];
 #ifndef BUG_LOAD_TAG
       addr->tag = lub(t, addr->tag);
@@ -273,12 +419,14 @@ Outcome step(Machine *machine) {
       break;
     case STORE:
 #ifndef BUG_STORE_UNDERFLOW
-      if (machine->sp < 2) {
+      if (machine->sp < BASE(machine) + 2) {
         return ERRORED;
       }
 #endif
       addr = &machine->stack[machine->sp-1];
       Atom data = machine->stack[machine->sp-2];
+      READ(machine, STK_LOC(machine->sp-1));
+      READ(machine, STK_LOC(machine->sp-2));
 #ifndef BUG_STORE_OOB
       if (addr->value >= MEM_LENGTH) {
         return ERRORED;
@@ -288,21 +436,32 @@ Outcome step(Machine *machine) {
       data.tag = lub(data.tag, addr->tag);
 #endif
 #ifndef BUG_STORE_TAG_2
+      READ(machine, MEM_LOC(addr->value));
       if (addr->tag > machine->memory[addr->value].tag) {
         return ERRORED;
       }
 #endif
+#if defined(CONTROL_FLOW) && !defined(BUG_STORE_PC)
+      // In a high context, only to high cells, and the data is high
+      if (machine->pc_tag > machine->memory[addr->value].tag) {
+        return ERRORED;
+      }
+      data.tag = lub(data.tag, machine->pc_tag);
+#endif
+      WRITE(machine, MEM_LOC(addr->value));
       machine->memory[addr->value] = data;
       machine->sp -= 2;
       break;
     case ADD:
 #ifndef BUG_ADD_UNDERFLOW
-      if (machine->sp < 2) {
+      if (machine->sp < BASE(machine) + 2) {
         return ERRORED;
       }
 #endif
       Atom data1 = machine->stack[machine->sp-1];
       Atom data2 = machine->stack[machine->sp-2];
+      READ(machine, STK_LOC(machine->sp-1));
+      READ(machine, STK_LOC(machine->sp-2));
 #ifndef BUG_ADD_INT_OVERFLOW
       if (data1.value > INT_MAX - data2.value) {
         return ERRORED;
@@ -313,11 +472,69 @@ Outcome step(Machine *machine) {
 #else
       Atom data3 = {lub(data1.tag, data2.tag), data1.value + data2.value};
 #endif
+      WRITE(machine, STK_LOC(machine->sp-2));
       machine->stack[machine->sp-2] = data3;
       machine->sp--;
       break;
     case HALT:
       return HALTED;
+#ifdef CONTROL_FLOW
+    // The pc tag rises with the tag of what decides where to go
+    case JUMP:
+      if (machine->sp < BASE(machine) + 1) {
+        return ERRORED;
+      }
+      Atom target = machine->stack[--machine->sp];
+#ifndef BUG_JUMP_TAG
+      machine->pc_tag = lub(machine->pc_tag, target.tag);
+#endif
+      machine->pc = target.value;
+      return STEPPED;
+    case BNZ:
+      if (machine->sp < BASE(machine) + 1) {
+        return ERRORED;
+      }
+      Atom cond = machine->stack[--machine->sp];
+#ifndef BUG_BNZ_TAG
+      machine->pc_tag = lub(machine->pc_tag, cond.tag);
+#endif
+      machine->pc += cond.value ? current_insn.immediate.value : 1;
+      return STEPPED;
+    case CALL:
+      // The target on top of the arguments
+      if (current_insn.immediate.value < 0
+          || current_insn.immediate.value > MAX_ARGS
+          || machine->sp < BASE(machine) + 1 + current_insn.immediate.value
+          || machine->fp == MAX_FRAMES) {
+        return ERRORED;
+      }
+      target = machine->stack[--machine->sp];
+      Frame *frame = &machine->frames[machine->fp++];
+      frame->pc = machine->pc + 1;
+      frame->tag = machine->pc_tag;
+      frame->sp = machine->sp - current_insn.immediate.value;
+#ifndef BUG_CALL_TAG
+      machine->pc_tag = lub(machine->pc_tag, target.tag);
+#endif
+      machine->pc = target.value;
+      return STEPPED;
+    case RETURN:
+      // One result, which carries the pc tag of the callee; the stack of
+      // the callee is dropped
+      if (machine->fp == 0 || machine->sp < BASE(machine) + 1) {
+        return ERRORED;
+      }
+      Atom result = machine->stack[machine->sp-1];
+#ifndef BUG_RETURN_TAG
+      result.tag = lub(result.tag, machine->pc_tag);
+#endif
+      frame = &machine->frames[--machine->fp];
+      machine->sp = frame->sp;
+      machine->stack[machine->sp++] = result;
+      machine->pc = frame->pc;
+      machine->pc_tag = frame->tag;
+      return STEPPED;
+#endif
     default:
       return ERRORED;
   }
@@ -326,16 +543,54 @@ Outcome step(Machine *machine) {
   return STEPPED;
 }
 
+#if defined(CONTROL_FLOW) && defined(RANDOM)
+unsigned long long steps_run; // by all runs
+#define COUNT_STEPS(n) (steps_run += (n))
+#else
+#define COUNT_STEPS(n)
+#endif
+
 Outcome run(Machine *machine) {
+#ifdef CONTROL_FLOW
+  for (int n = 0; n < STEP_BUDGET; n++) {
+    Outcome outcome = step(machine);
+    if (outcome != STEPPED) {
+      COUNT_STEPS(n);
+      // Only the runs that end in a low context are compared: in a high
+      // one, the other machine may well still be running
+      if (outcome != ERRORED && machine->pc_tag == H)
+        return ERRORED;
+      return outcome;
+    }
+  }
+  COUNT_STEPS(STEP_BUDGET);
+  return ERRORED;
+#else
   while (step(machine) == STEPPED) {
     ;
   }
   return step(machine);
+#endif
 }
 
+#ifdef CONTROL_FLOW
+// Low pc, no call
+void init_control(Machine *machine) {
+  machine->pc_tag = L;
+  machine->fp = 0;
+}
+#endif
+
 void copy_machine(Machine* from, Machine *to) {
   to->pc = from->pc;
   to->sp = from->sp;
+#ifdef CONTROL_FLOW
+  to->pc_tag = from->pc_tag;
+  to->fp = from->fp;
+  for (int i = 0; i < from->fp; i++) {
+    to->frames[i] = from->frames[i];
+  }
+#endif
   for (int i = 0; i < from->sp; i++) {
     to->stack[i] = from->stack[i];
   }
@@ -391,7 +646,7 @@ int indist_machine(Machine *m1, Machine *m2) {
 #undef ASSERT
 #endif
 
-#ifndef RANDOM
+#if !defined(RANDOM) && !defined(EXPLORE) && !defined(FUZZ)
 void assume_indist_atom(Atom a, Atom b) {
   klee_assume(a.tag == b.tag);
 #ifdef BRANCHFREE_TAG
@@ -409,6 +664,11 @@ void assume_indist_insn(Insn i1, Insn i2) {
   if (i1.t == PUSH) {
     assume_indist_atom(i1.immediate, i2.immediate);
   }
+#ifdef CONTROL_FLOW
+  if (i1.t == BNZ || i1.t == CALL) {
+    klee_assume(i1.immediate.value == i2.immediate.value);
+  }
+#endif
 }
 
 void assume_indist_machine(Machine *m1, Machine *m2) {
@@ -432,13 +692,34 @@ void assume_bounded_tag(Tag tag) {
 
 void assume_bounded_insn(InsnType t) {
   klee_assume(NOOP <= t);
-  klee_assume(t <= HALT);
+  klee_assume(t < INSN_TYPES);
+}
+
+// Immediates of PUSH are values, those of the control flow instructions
+// have their own ranges
+void assume_valid_immediate(InsnType t, Atom a) {
+  assume_bounded_tag(a.tag);
+#ifdef CONTROL_FLOW
+  if (t == BNZ) {
+    klee_assume(a.value >= -BNZ_RANGE);
+    klee_assume(a.value <= BNZ_RANGE);
+    return;
+  }
+  if (t == CALL) {
+    klee_assume(a.value <= MAX_ARGS);
+  }
+#endif
+  klee_assume(a.value >= 0);
 }
 
 void assume_valid_machine(Machine *machine) {
   // Why can't we use &&
   klee_assume(0 == machine->pc);
   //klee_assume(machine->pc < PRG_LENGTH);
+#ifdef CONTROL_FLOW
+  klee_assume(machine->pc_tag == L);
+  klee_assume(machine->fp == 0);
+#endif
 #ifndef EMPTY_STACK
   klee_assume(0 <= machine->sp);
   klee_assume(machine->sp < STK_LENGTH);
@@ -464,14 +745,37 @@ void assume_valid_machine(Machine *machine) {
 #endif
 
   for (int i = 0 ; i < PRG_LENGTH ; i++) {
-    assume_bounded_tag(machine->insns[i].immediate.tag);
     assume_bounded_insn(machine->insns[i].t);
-    klee_assume(machine->insns[i].immediate.value >= 0);
+    assume_valid_immediate(machine->insns[i].t, machine->insns[i].immediate);
     // klee_prefer_cex(machine->insns, machine->insns[i].t == NOOP);
     // klee_assume(machine->insns[i].immediate.value < MEM_LENGTH);
   }
 }
 
+#ifdef SLICE
+// Restrict the initial machine to one slice of the input space.
+// Slices are disjoint, so they can be explored by separate Klee processes
+// (make klee-slices).
+void assume_slice(Machine *machine, int slice) {
+#if defined(SLICE_BY_SP)
+  klee_assume(machine->sp == slice);
+#elif defined(SLICE_BY_INSN01)
+  klee_assume(machine->insns[0].t == slice / INSN_TYPES);
+  klee_assume(machine->insns[1].t == slice % INSN_TYPES);
+#elif defined(SLICE_BY_TAGS)
+  // Tags of the first SLICE_TAG_BITS memory cells.
+#ifndef SLICE_TAG_BITS
+#define SLICE_TAG_BITS MEM_LENGTH
+#endif
+  for (int i = 0; i < SLICE_TAG_BITS; i++) {
+    klee_assume(machine->memory[i].tag == ((slice >> i) & 1));
+  }
+#else
+  klee_assume(machine->insns[0].t == slice);
+#endif
+}
+#endif
+
 #ifdef REPLAY_MANUAL
 void read_machine(Machine* to) {
   to->pc = 0;
@@ -510,6 +814,23 @@ void read_machine(Machine* to) {
       case 'O':
         next_insn->t = NOOP;
         break;
+#ifdef CONTROL_FLOW
+      case 'J':
+        next_insn->t = JUMP;
+        break;
+      case 'B':
+        // Signed offset
+        next_insn->t = BNZ;
+        next_insn->immediate.value = (int) strtol(src, &src, 10);
+        break;
+      case 'C':
+        next_insn->t = CALL;
+        next_insn->immediate.value = (int) (*src++ - '0');
+        break;
+      case 'R':
+        next_insn->t = RETURN;
+        break;
+#endif
       default:
         do {
           to->insns[i].t = NOOP;
@@ -532,6 +853,177 @@ int rand1(){
 }
 #endif
 
+#ifdef LEAN_INPUTS
+#ifdef RANDOMIZE
+#error "LEAN_INPUTS: RANDOMIZE only fixes the inputs of the default harness"
+#endif
+
+// Value of an atom of machine 1 in machine 2: the same if it is low,
+// the separate high value otherwise.
+int value2(Atom a, int high_value) {
+#ifdef BRANCHFREE_TAG
+  return (a.value & -(int) (a.tag == L)) | (high_value & -(int) (a.tag == H));
+#else
+  if (a.tag == L)
+    return a.value;
+  else
+    return high_value;
+#endif
+}
+
+void assume_valid_atom(Atom a) {
+  assume_bounded_tag(a.tag);
+  klee_assume(a.value >= 0);
+}
+
+// Only the free inputs are symbolic: the initial stack pointer, the opcodes,
+// the atoms of machine 1, and the values taken in machine 2 by high atoms.
+// Both machines are built from them, so they are indistinguishable by
+// construction and no pointer or redundant byte is symbolic.
+int main() {
+  Machine machine1, machine1_, machine2;
+  MemAtom
+    memory1[MEM_LENGTH], memory1_[MEM_LENGTH],
+    memory2[MEM_LENGTH];
+  StkAtom
+    stack1[STK_LENGTH], stack1_[STK_LENGTH],
+    stack2[STK_LENGTH];
+  Insn insns1[PRG_LENGTH], insns2[PRG_LENGTH];
+
+  int sp = 0;
+  InsnType opcodes[PRG_LENGTH];
+  Atom immediates[PRG_LENGTH];
+  int immediates_hi[PRG_LENGTH];
+  int stack_hi[STK_LENGTH];
+#ifndef ZERO_MEMORY
+  int memory_hi[MEM_LENGTH];
+#endif
+
+  klee_make_symbolic(&opcodes, sizeof opcodes, "opcodes");
+  klee_make_symbolic(&immediates, sizeof immediates, "immediates");
+  klee_make_symbolic(&immediates_hi, sizeof immediates_hi, "immediates_hi");
+#ifndef EMPTY_STACK
+  klee_make_symbolic(&sp, sizeof sp, "sp");
+  klee_make_symbolic(&stack1, sizeof stack1, "stack");
+  klee_make_symbolic(&stack_hi, sizeof stack_hi, "stack_hi");
+#endif
+#ifdef ZERO_MEMORY
+  for (int i = 0; i < MEM_LENGTH; i++) {
+    memory1[i].tag = L;
+    memory1[i].value = 0;
+  }
+#else
+  klee_make_symbolic(&memory1, sizeof memory1, "memory");
+  klee_make_symbolic(&memory_hi, sizeof memory_hi, "memory_hi");
+#endif
+
+  machine1.pc = 0;
+  machine1.sp = sp;
+  machine1.memory = memory1;
+  machine1.stack = stack1;
+  machine1.insns = insns1;
+#ifdef CONTROL_FLOW
+  init_control(&machine1);
+#endif
+
+  klee_assume(0 <= sp);
+  klee_assume(sp < STK_LENGTH);
+  for (int i = 0; i < sp; i++) {
+    assume_valid_atom(stack1[i]);
+  }
+#ifndef ZERO_MEMORY
+  for (int i = 0; i < MEM_LENGTH; i++) {
+    assume_valid_atom(memory1[i]);
+  }
+#endif
+  for (int i = 0; i < PRG_LENGTH; i++) {
+    assume_bounded_insn(opcodes[i]);
+    assume_valid_immediate(opcodes[i], immediates[i]);
+    insns1[i].t = opcodes[i];
+    insns1[i].immediate = immediates[i];
+  }
+#ifdef SLICE
+  assume_slice(&machine1, SLICE);
+#endif
+
+  machine1_.memory = memory1_;
+  machine1_.stack = stack1_;
+  machine1_.insns = insns1;
+  copy_machine(&machine1, &machine1_);
+
+  if (run(&machine1) == ERRORED) {
+#ifdef REPLAY
+    printf("Machine 1 error\n");
+#endif
+    klee_silent_exit(1);
+  }
+
+  // Machine 2 is built from the initial state of machine 1.
+  machine2.pc = 0;
+  machine2.sp = sp;
+  machine2.memory = memory2;
+  machine2.stack = stack2;
+  machine2.insns = insns2;
+#ifdef CONTROL_FLOW
+  init_control(&machine2);
+#endif
+  for (int i = 0; i < sp; i++) {
+    klee_assume(stack_hi[i] >= 0);
+    stack2[i].tag = stack1_[i].tag;
+    stack2[i].value = value2(stack1_[i], stack_hi[i]);
+  }
+  for (int i = 0; i < MEM_LENGTH; i++) {
+    memory2[i].tag = memory1_[i].tag;
+#ifdef ZERO_MEMORY
+    memory2[i].value = 0;
+#else
+    klee_assume(memory_hi[i] >= 0);
+    memory2[i].value = value2(memory1_[i], memory_hi[i]);
+#endif
+  }
+  for (int i = 0; i < PRG_LENGTH; i++) {
+    klee_assume(immediates_hi[i] >= 0);
+    insns2[i].t = opcodes[i];
+    insns2[i].immediate.tag = immediates[i].tag;
+    insns2[i].immediate.value = value2(immediates[i], immediates_hi[i]);
+#ifdef CONTROL_FLOW
+    // Not a value: the same in both machines
+    if (opcodes[i] != PUSH) {
+      insns2[i].immediate.value = immediates[i].value;
+    }
+#endif
+  }
+
+#ifdef REPLAY
+  Machine machine2_;
+  MemAtom memory2_[MEM_LENGTH];
+  StkAtom stack2_[STK_LENGTH];
+  machine2_.memory = memory2_;
+  machine2_.stack = stack2_;
+  machine2_.insns = insns2;
+  copy_machine(&machine2, &machine2_);
+  printf("*** Initial\n");
+  print_machine_pair(&machine1_, &machine2_);
+#endif
+
+  if (run(&machine2) == ERRORED) {
+#ifdef REPLAY
+    printf("Machine 2 error\n");
+#endif
+    klee_silent_exit(1);
+  }
+
+#ifdef REPLAY
+  printf("*** Final\n");
+  print_machine_pair(&machine1, &machine2);
+#endif
+  if (!indist_machine(&machine1, &machine2)) {
+    klee_abort();
+  }
+
+  return 0;
+}
+#else
 int main() {
   Machine machine1, machine1_, machine2;
   MemAtom
@@ -629,6 +1121,9 @@ int main() {
   //klee_assume(machine1.insns[3].t == HALT);
 
   assume_valid_machine(&machine1);
+#ifdef SLICE
+  assume_slice(&machine1, SLICE);
+#endif
   // assume_valid_machine(&machine2);
   // assume_indist_machine(&machine1, &machine2);
 
@@ -677,27 +1172,55 @@ int main() {
 
   return 0;
 }
+#endif
+
+#elif defined(RANDOM)
+
+// Every test draws from its own stream, seeded by the seed of the campaign
+// and the index of the test (splitmix64): any range of tests gives the same
+// tests on its own, so campaigns can be resumed and split into shards.
+static unsigned long long prng_state;
+
+static unsigned long long splitmix(unsigned long long *x) {
+  unsigned long long z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void seed_test(unsigned seed, long index) {
+  prng_state = (unsigned long long) seed << 32 ^ (unsigned long) index;
+  prng_state = splitmix(&prng_state);
+}
 
-#else  // ifdef RANDOM
+// Non-negative, like rand()
+int random_int() {
+  return (int) (splitmix(&prng_state) >> 33);
+}
 
 int random_value() {
-  // return rand();
-  return rand()%MEM_LENGTH;
+  // return random_int();
+  return random_int()%MEM_LENGTH;
 }
 
-void random_atoms(Atom *a1, Atom *a2) {
-  int tagid = rand()%2;
+// Values below n
+void random_atoms_below(Atom *a1, Atom *a2, int n) {
+  int tagid = random_int()%2;
   if(tagid){
     a1->tag = a2->tag = L;
-    a1->value = a2->value = random_value();
+    a1->value = a2->value = random_int()%n;
   }
   else{
     a1->tag = a2->tag = H;
-    a1->value = random_value();
-    a2->value = random_value();
+    a1->value = random_int()%n;
+    a2->value = random_int()%n;
   }
 }
 
+void random_atoms(Atom *a1, Atom *a2) {
+  random_atoms_below(a1, a2, MEM_LENGTH);
+}
+
 void init_memories(MemAtom *memory1, MemAtom *memory2) {
   for (int i = 0; i < MEM_LENGTH; i++) {
 #ifdef ZERO_MEMORY
@@ -713,26 +1236,229 @@ void init_stacks(int *sp1, StkAtom *stack1, int *sp2, StkAtom *stack2) {
 #ifdef EMPTY_STACK
   *sp1 = *sp2 = 0;
 #else
-  int sp = *sp1 = *sp2 = rand()%STK_LENGTH;
+  int sp = *sp1 = *sp2 = random_int()%STK_LENGTH;
   for (int i = 0; i < sp; i++){
     random_atoms(&stack1[i], &stack2[i]);
   }
 #endif
 }
 
+void random_insns(Insn *insn1, Insn *insn2) {
+  InsnType ins = (InsnType) (random_int()%INSN_TYPES);
+  insn1->t = insn2->t = ins;
+  if (ins == PUSH) {
+#ifdef CONTROL_FLOW
+    // Half of them addresses of instructions
+    if (random_int()%2) {
+      random_atoms_below(&insn1->immediate, &insn2->immediate, PRG_LENGTH);
+      return;
+    }
+#endif
+    random_atoms(&insn1->immediate, &insn2->immediate);
+  }
+#ifdef CONTROL_FLOW
+  if (ins == BNZ || ins == CALL) {
+    insn1->immediate.tag = L;
+    insn1->immediate.value = ins == BNZ
+      ? random_int()%(2*BNZ_RANGE + 1) - BNZ_RANGE
+      : random_int()%(MAX_ARGS + 1);
+    insn2->immediate = insn1->immediate;
+  }
+#endif
+}
+
+#ifdef CONTROL_FLOW
+// Instructions are drawn when first fetched, each from its own stream: a
+// test only pays for the instructions it runs, whatever PRG_LENGTH.
+static Insn *program1, *program2;  // of the current test
+static unsigned long long program_key;  // of the streams of its instructions
+static unsigned long long program_id;  // counts tests
+static unsigned long long drawn[PRG_LENGTH];  // program_id of the last draw
+
+void draw_insn(int pc) {
+  if (drawn[pc] == program_id)
+    return;
+  drawn[pc] = program_id;
+  unsigned long long saved = prng_state;
+  prng_state = program_key ^ (unsigned long long) pc * 0xd1b54a32d192ed03ULL;
+  prng_state = splitmix(&prng_state);
+  random_insns(&program1[pc], &program2[pc]);
+  prng_state = saved;
+}
+
+void init_insns(Insn *insns1, Insn *insns2) {
+  program1 = insns1;
+  program2 = insns2;
+  program_key = splitmix(&prng_state);
+  program_id++;
+}
+#else
 void init_insns(Insn *insns1, Insn *insns2) {
   for (int i = 0;i < PRG_LENGTH;i++){
-    InsnType ins = (InsnType) (rand()%7);
-    insns1[i].t = insns2[i].t = ins;
-    if (insns1[i].t == PUSH) {
-      random_atoms(&insns1[i].immediate, &insns2[i].immediate);
-    }
+    random_insns(&insns1[i], &insns2[i]);
   }
 }
+#endif
 
 enum TestOutcome { SUCCESS, FAILURE, DISCARD };
 
-enum TestOutcome run_test() {
+#ifdef MEMO_CACHE
+#ifdef CONTROL_FLOW
+#error "MEMO_CACHE: programs are drawn as they run with CONTROL_FLOW"
+#endif
+
+// Cache of outcomes. Given the program and sp, a run reads the same
+// locations and computes the same final state from any initial state that
+// agrees on the initial values it read. The cells written by neither
+// machine keep their initial values, indistinguishable by construction; a
+// cell written by one machine only is compared to its initial value in the
+// other. An entry keeps these locations (read by either machine, or written
+// by one), their initial values in both machines, and the outcome: a test
+// whose program, sp and values at these locations match has this outcome,
+// without running the machines. An entry lists its locations, so that its
+// size and a lookup do not grow with the memory.
+#ifndef MEMO_BUCKETS
+#define MEMO_BUCKETS (1 << 10) // in the caches of the CPU
+#endif
+#define MEMO_WAYS 4
+// Each step of either machine reads at most 3 locations and writes 1
+#define MEMO_LOCS (8 * PRG_LENGTH < LOCATIONS ? 8 * PRG_LENGTH : LOCATIONS)
+
+typedef struct {
+  int sp, nlocs;
+  Insn insns1[PRG_LENGTH], insns2[PRG_LENGTH];
+  int locs[MEMO_LOCS];
+  Atom initial1[MEMO_LOCS], initial2[MEMO_LOCS];
+  enum TestOutcome outcome;
+} MemoEntry;
+
+// Hashes of the programs and sp of the entries of a bucket (0: unused), in
+// one cache line
+typedef struct {
+  unsigned long long keys[MEMO_WAYS];
+  unsigned victim;
+} MemoBucket;
+
+static MemoBucket memo_buckets[MEMO_BUCKETS];
+static MemoEntry memo[MEMO_BUCKETS][MEMO_WAYS];
+
+// Lookups and hits, and sampled times of lookups, runs (with the check) and
+// insertions, to estimate the time saved
+static struct {
+  long lookups, hits, inserts, uncached;
+  double lookup_time, run_time, insert_time;
+  long lookup_samples, run_samples, insert_samples;
+  double clock_time; // of now(), part of every sampled time
+} memo_stats;
+
+#define MEMO_SAMPLE 64
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void measure_clock(void) {
+  double t0 = now(), t1 = t0;
+  for (int i = 0; i < 1000; i++)
+    t1 = now();
+  memo_stats.clock_time = (t1 - t0) / 1000;
+}
+
+// Immediates only count for PUSH (they are not drawn for other opcodes)
+static int same_insn(Insn a, Insn b) {
+  return a.t == b.t && (a.t != PUSH || (a.immediate.tag == b.immediate.tag
+                                        && a.immediate.value == b.immediate.value));
+}
+
+static int same_atom(Atom a, Atom b) {
+  return a.tag == b.tag && a.value == b.value;
+}
+
+static Atom initial_atom(Machine *m, int loc) {
+  return loc < MEM_LENGTH ? m->memory[loc] : m->stack[loc - MEM_LENGTH];
+}
+
+// Non-zero hash of the program pair and sp
+static unsigned long long memo_key(Machine *m1, Machine *m2) {
+  unsigned long long h = m1->sp;
+  for (int i = 0; i < PRG_LENGTH; i++) {
+    h = h * 31 + m1->insns[i].t;
+    if (m1->insns[i].t == PUSH)
+      h = ((h * 31 + m1->insns[i].immediate.tag) * 31
+           + m1->insns[i].immediate.value) * 31 + m2->insns[i].immediate.value;
+  }
+  return splitmix(&h) | 1;
+}
+
+// Entry matching the initial pair of key, or NULL
+static MemoEntry *memo_lookup(Machine *m1, Machine *m2,
+                              unsigned long long key) {
+  unsigned b = key % MEMO_BUCKETS;
+  for (int w = 0; w < MEMO_WAYS; w++) {
+    if (memo_buckets[b].keys[w] != key)
+      continue;
+    MemoEntry *e = &memo[b][w];
+    int match = e->sp == m1->sp;
+    for (int i = 0; match && i < PRG_LENGTH; i++)
+      match = same_insn(e->insns1[i], m1->insns[i])
+        && same_insn(e->insns2[i], m2->insns[i]);
+    for (int i = 0; match && i < e->nlocs; i++)
+      match = same_atom(e->initial1[i], initial_atom(m1, e->locs[i]))
+        && same_atom(e->initial2[i], initial_atom(m2, e->locs[i]));
+    if (match)
+      return e;
+  }
+  return NULL;
+}
+
+// Initial pair m1, m2 of key whose runs depend on the locations reads,
+// replacing the ways of the bucket in turn
+static void memo_insert(Machine *m1, Machine *m2, unsigned long long key,
+                        LocSet *reads, enum TestOutcome outcome) {
+  unsigned b = key % MEMO_BUCKETS;
+  unsigned w = memo_buckets[b].victim++ % MEMO_WAYS;
+  memo_buckets[b].keys[w] = key;
+  MemoEntry *e = &memo[b][w];
+  e->sp = m1->sp;
+  for (int i = 0; i < PRG_LENGTH; i++) {
+    e->insns1[i] = m1->insns[i];
+    e->insns2[i] = m2->insns[i];
+  }
+  e->nlocs = 0;
+  for (int k = 0; k < LOC_WORDS; k++)
+    for (unsigned long long r = reads->w[k]; r; r &= r - 1) {
+      int loc = 64 * k + __builtin_ctzll(r);
+      e->locs[e->nlocs] = loc;
+      e->initial1[e->nlocs] = initial_atom(m1, loc);
+      e->initial2[e->nlocs++] = initial_atom(m2, loc);
+    }
+  e->outcome = outcome;
+}
+
+// Hits saved a run each (estimated by the sampled times), at the price of
+// every lookup and insertion
+static void print_memo_stats(FILE *f) {
+#define MEAN(x) (memo_stats.x##_samples ? memo_stats.x##_time \
+                 / memo_stats.x##_samples - memo_stats.clock_time : 0)
+  long misses = memo_stats.lookups - memo_stats.hits;
+  double saved = memo_stats.hits * MEAN(run)
+    - memo_stats.lookups * MEAN(lookup) - memo_stats.inserts * MEAN(insert);
+  fprintf(f, "cache %ld hits of %ld lookups (%.1f%%), %ld not cacheable, "
+          "saved %.3f s\n", memo_stats.hits, memo_stats.lookups,
+          memo_stats.lookups ? 100.0 * memo_stats.hits / memo_stats.lookups : 0,
+          memo_stats.uncached, saved);
+  fprintf(f, "cache per test: run %.0f ns, lookup %.0f ns, insertion %.0f ns"
+          " (%ld misses)\n", MEAN(run) * 1e9, MEAN(lookup) * 1e9,
+          MEAN(insert) * 1e9, misses);
+#undef MEAN
+}
+#endif
+
+// Test index of the campaign seed, printing both pairs of machines if
+// verbose
+enum TestOutcome run_test(unsigned seed, long index, int verbose) {
   Machine machine1, machine1_, machine2,machine2_;
   MemAtom
     memory1[MEM_LENGTH], memory1_[MEM_LENGTH],
@@ -751,10 +1477,47 @@ enum TestOutcome run_test() {
   machine2.memory = memory2;
   machine2.stack = stack2;
   machine2.insns = insns2;
+#ifdef CONTROL_FLOW
+  init_control(&machine1);
+  init_control(&machine2);
+#endif
 
+  seed_test(seed, index);
   init_memories(memory1, memory2);
   init_stacks(&machine1.sp, stack1, &machine2.sp, stack2);
   init_insns(insns1, insns2);
+#ifdef CONTROL_FLOW
+  // The whole program, to print it
+  for (int i = 0; verbose && i < PRG_LENGTH; i++)
+    draw_insn(i);
+#endif
+
+#ifdef MEMO_CACHE
+  // Not for printed tests, which run
+  int sample = 0;
+  double t0 = 0;
+  unsigned long long key = 0;
+  if (!verbose) {
+    sample = memo_stats.lookups++ % MEMO_SAMPLE == 0;
+    if (sample)
+      t0 = now();
+    key = memo_key(&machine1, &machine2);
+    MemoEntry *hit = memo_lookup(&machine1, &machine2, key);
+    if (sample) {
+      double t1 = now();
+      memo_stats.lookup_time += t1 - t0;
+      memo_stats.lookup_samples++;
+      t0 = t1;
+    }
+    if (hit) {
+      memo_stats.hits++;
+      return hit->outcome;
+    }
+  }
+  static const LocSet no_locs;
+  machine1.reads = machine1.writes = machine2.reads = machine2.writes = no_locs;
+  machine1.oob = machine2.oob = 0;
+#endif
 
   machine1_.memory = memory1_;
   machine1_.stack = stack1_;
@@ -766,54 +1529,440 @@ enum TestOutcome run_test() {
   machine2_.insns = insns2;
   copy_machine(&machine2, &machine2_);
 
+  enum TestOutcome outcome;
   if (run(&machine1) == ERRORED || run(&machine2) == ERRORED) {
-    return DISCARD;
-  }
+    if (verbose)
+      printf("Discarded\n");
+    outcome = DISCARD;
+  } else {
+    if (verbose) {
+      printf("Initial\n");
+      print_machine_pair(&machine1_,&machine2_);
+      printf("Final\n");
+      print_machine_pair(&machine1,&machine2);
+    }
 
-  /*
-  printf("Initial\n");
-  print_machine_pair(&machine1_,&machine2_);
-  printf("Final\n");
-  print_machine_pair(&machine1,&machine2);
-  printf("\n");
-  */
+    if (!indist_machine(&machine1, &machine2)) {
+      // printf("**************BUG***************\n");
+      outcome = FAILURE;
+    } else {
+      outcome = SUCCESS;
+    }
+  }
 
-  if (!indist_machine(&machine1, &machine2)) {
-    // printf("**************BUG***************\n");
-    return FAILURE;
+#ifdef MEMO_CACHE
+  if (!verbose) {
+    if (sample) {
+      double t1 = now();
+      memo_stats.run_time += t1 - t0;
+      memo_stats.run_samples++;
+      t0 = t1;
+    }
+    // And memory cells written by one machine only (indist_machine()
+    // compares the memories only)
+    LocSet reads;
+    int nlocs = 0;
+    for (int k = 0; k < LOC_WORDS; k++) {
+      unsigned long long cells = 64 * (k + 1) <= MEM_LENGTH ? ~0ULL
+        : 64 * k >= MEM_LENGTH ? 0 : (1ULL << (MEM_LENGTH - 64 * k)) - 1;
+      reads.w[k] = machine1.reads.w[k] | machine2.reads.w[k]
+        | ((machine1.writes.w[k] ^ machine2.writes.w[k]) & cells);
+      nlocs += __builtin_popcountll(reads.w[k]);
+    }
+    if (machine1.oob || machine2.oob || nlocs > MEMO_LOCS) {
+      memo_stats.uncached++;
+    } else {
+      memo_insert(&machine1_, &machine2_, key, &reads, outcome);
+      memo_stats.inserts++;
+      if (sample) {
+        memo_stats.insert_time += now() - t0;
+        memo_stats.insert_samples++;
+      }
+    }
   }
+#endif
+  return outcome;
+}
+
+// State of a campaign: tests first to first + runs - 1 of a seed. It is
+// saved to the checkpoint file, in the format of the output plus the
+// position and the first failures (see misc/merge_random.sh):
+//   good bad ugly
+//   first INDEX SECONDS
+//   campaign SEED FIRST RUNS NEXT SECONDS
+//   failures N INDEX...
+// Indices of failures count from 1; times are CPU seconds of the campaign.
+#define MAX_FAILURES 100
+
+typedef struct {
+  unsigned seed;
+  long first, runs, next;
+  long good, bad, ugly;
+  long first_failure; // -1 if none
+  double first_time, elapsed;
+  int nfailures;
+  long failures[MAX_FAILURES];
+} Campaign;
+
+static int write_campaign(FILE *f, const Campaign *c) {
+  fprintf(f, "%ld %ld %ld\n", c->good, c->bad, c->ugly);
+  fprintf(f, "first %ld %.6f\n", c->first_failure,
+          c->first_failure < 0 ? c->elapsed : c->first_time);
+  fprintf(f, "campaign %u %ld %ld %ld %.6f\n", c->seed, c->first, c->runs,
+          c->next, c->elapsed);
+  fprintf(f, "failures %d", c->nfailures);
+  for (int i = 0; i < c->nfailures; i++)
+    fprintf(f, " %ld", c->failures[i]);
+  fprintf(f, "\n");
+  return ferror(f);
+}
+
+// Written to a temporary file renamed over the checkpoint, which is always
+// complete.
+static int save_campaign(const char *file, const Campaign *c) {
+  char tmp[4096];
+  snprintf(tmp, sizeof tmp, "%s.tmp", file);
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return -1;
+  int error = write_campaign(f, c);
+  if (fclose(f) || error || rename(tmp, file))
+    return -1;
+  return 0;
+}
+
+// 1 if loaded, 0 if there is no checkpoint, -1 if it is invalid
+static int load_campaign(const char *file, Campaign *c) {
+  FILE *f = fopen(file, "r");
+  if (!f)
+    return 0;
+  int ok = 3 == fscanf(f, "%ld %ld %ld", &c->good, &c->bad, &c->ugly)
+    && 2 == fscanf(f, " first %ld %lf", &c->first_failure, &c->first_time)
+    && 5 == fscanf(f, " campaign %u %ld %ld %ld %lf", &c->seed, &c->first,
+                   &c->runs, &c->next, &c->elapsed)
+    && 1 == fscanf(f, " failures %d", &c->nfailures)
+    && c->nfailures >= 0 && c->nfailures <= MAX_FAILURES;
+  for (int i = 0; ok && i < c->nfailures; i++)
+    ok = 1 == fscanf(f, "%ld", &c->failures[i]);
+  fclose(f);
+  return ok ? 1 : -1;
+}
 
-  return SUCCESS;
+// Set by SIGINT and SIGTERM: stop, save and print the counts so far
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig) {
+  (void) sig;
+  stop = 1;
 }
 
 void usage(char *name) {
-  fprintf(stderr, "Usage: %s [NUM RUNS]\n", name);
+  fprintf(stderr,
+          "Usage: %s [-c CHECKPOINT] [-i SECONDS] [-x INDEX] RUNS [SEED [FIRST]]\n"
+          "Runs tests FIRST to FIRST + RUNS - 1 (default FIRST: 0) of SEED\n"
+          "(default: 44), each drawn from its own random stream.\n"
+          "  -c  save the campaign to CHECKPOINT every SECONDS (default: 60),\n"
+          "      on SIGINT/SIGTERM and at the end; resume from it if it exists\n"
+          "  -x  only print test INDEX (from 1, as in the output) of SEED and its\n"
+          "      outcome\n"
+          "SIGINT and SIGTERM stop the campaign, which prints its counts so far.\n",
+          name);
 }
 
+// Prints "good bad ugly", then the index (from 1) of the first failing test
+// and the time in seconds to reach it, -1 and the total time if none.
 int main(int argc, char *argv[]) {
 #define ASSERT(x) if(!(x)) { usage(argv[0]); return 1; }
 
-  int runs;
-  ASSERT(argc >= 2);
-  ASSERT(1 == sscanf(argv[1], "%d", &runs));
-  srand(44);
-  int good = 0, bad = 0, ugly = 0;
-  for (int i = 0; i < runs; i++) {
-    switch (run_test()) {
+  const char *checkpoint = NULL;
+  int interval = 60;
+  long show = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:i:x:")) != -1) {
+    switch (opt) {
+      case 'c': checkpoint = optarg; break;
+      case 'i': ASSERT(1 == sscanf(optarg, "%d", &interval)); break;
+      case 'x': ASSERT(1 == sscanf(optarg, "%ld", &show) && show > 0); break;
+      default: ASSERT(0);
+    }
+  }
+
+  Campaign c = { .seed = 44, .first_failure = -1 };
+  ASSERT(argc - optind >= 1);
+  ASSERT(1 == sscanf(argv[optind], "%ld", &c.runs));
+  if (argc - optind >= 2)
+    ASSERT(1 == sscanf(argv[optind + 1], "%u", &c.seed));
+  if (argc - optind >= 3)
+    ASSERT(1 == sscanf(argv[optind + 2], "%ld", &c.first));
+  c.next = c.first;
+
+  if (show) {
+    enum TestOutcome outcome = run_test(c.seed, show - 1, 1);
+    printf("%s\n", outcome == SUCCESS ? "Success"
+                   : outcome == FAILURE ? "Failure" : "Discard");
+    return 0;
+  }
+
+  if (checkpoint) {
+    Campaign saved;
+    int loaded = load_campaign(checkpoint, &saved);
+    if (loaded < 0) {
+      fprintf(stderr, "%s: invalid checkpoint\n", checkpoint);
+      return 1;
+    }
+    if (loaded && (saved.seed != c.seed || saved.first != c.first
+                   || saved.runs != c.runs)) {
+      fprintf(stderr, "%s: checkpoint of another campaign (seed %u, tests "
+              "%ld to %ld)\n", checkpoint, saved.seed, saved.first,
+              saved.first + saved.runs - 1);
+      return 1;
+    }
+    if (loaded)
+      c = saved;
+  }
+  // Stopped early, the tests run so far are still reported
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  double elapsed = c.elapsed; // before this run
+  clock_t start = clock();
+#ifdef CONTROL_FLOW
+  steps_run = 0;
+#endif
+  time_t saved_at = time(NULL);
+  while (c.next < c.first + c.runs && !stop) {
+    switch (run_test(c.seed, c.next, 0)) {
       case SUCCESS:
-        good++;
+        c.good++;
         break;
       case FAILURE:
-        bad++;
+        if (c.bad++ == 0) {
+          c.first_failure = c.next + 1;
+          c.first_time = elapsed + (double) (clock() - start) / CLOCKS_PER_SEC;
+        }
+        if (c.nfailures < MAX_FAILURES)
+          c.failures[c.nfailures++] = c.next + 1;
         break;
       case DISCARD:
       default:
-        ugly++;
+        c.ugly++;
         break;
     }
+    // Counted: a checkpoint saved from now on resumes after it
+    c.next++;
+    if (checkpoint && (c.next & 1023) == 0
+        && time(NULL) - saved_at >= interval) {
+      c.elapsed = elapsed + (double) (clock() - start) / CLOCKS_PER_SEC;
+      if (save_campaign(checkpoint, &c))
+        perror(checkpoint);
+      saved_at = time(NULL);
+    }
   }
-  printf("%d %d %d\n", good, bad, ugly);
-  return 0;
+  c.elapsed = elapsed + (double) (clock() - start) / CLOCKS_PER_SEC;
+  if (checkpoint && save_campaign(checkpoint, &c)) {
+    perror(checkpoint);
+    return 1;
+  }
+  printf("%ld %ld %ld\n", c.good, c.bad, c.ugly);
+  printf("first %ld %.6f\n", c.first_failure,
+         c.first_failure < 0 ? c.elapsed : c.first_time);
+#ifdef MEMO_CACHE
+  // Of this run only, on stderr: the output is that of the campaign
+  measure_clock();
+  print_memo_stats(stderr);
+#endif
+#ifdef CONTROL_FLOW
+  // Also of this run only
+  double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+  fprintf(stderr, "steps %llu %.0f\n", steps_run,
+          seconds > 0 ? steps_run / seconds : 0);
+#endif
+  // Interrupted: the checkpoint has the rest
+  return stop ? 2 : 0;
 #undef ASSERT
 }
+
+#elif defined(FUZZ)
+#include <stdint.h>
+#include <string.h>
+
+// Entry points for libFuzzer (make fuzz). An input is the free part of a
+// pair of indistinguishable machines, as in the LEAN harness: one byte per
+// opcode, sp, tag and value, plus the value in machine 2 of every atom,
+// used if the atom is high. Bytes are reduced to their valid range, so any
+// input, whatever the mutation, is a valid pair.
+typedef struct {
+  uint8_t tag;
+  uint8_t value;
+  uint8_t hi;
+} FuzzAtom;
+
+typedef struct {
+  uint8_t sp;
+  uint8_t opcodes[PRG_LENGTH];
+  FuzzAtom immediates[PRG_LENGTH];
+  FuzzAtom stack[STK_LENGTH];
+  FuzzAtom memory[MEM_LENGTH];
+} FuzzPair;
+
+void fuzz_atoms(FuzzAtom f, Atom *a1, Atom *a2) {
+  a1->tag = a2->tag = (f.tag & 1) ? H : L;
+  a1->value = f.value;
+  a2->value = a1->tag == L ? f.value : f.hi;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  Machine machine1, machine1_, machine2, machine2_;
+  MemAtom
+    memory1[MEM_LENGTH], memory1_[MEM_LENGTH],
+    memory2[MEM_LENGTH], memory2_[MEM_LENGTH];
+  StkAtom
+    stack1[STK_LENGTH], stack1_[STK_LENGTH],
+    stack2[STK_LENGTH], stack2_[STK_LENGTH];
+  Insn insns1[PRG_LENGTH], insns2[PRG_LENGTH];
+  FuzzPair p;
+
+  memset(&p, 0, sizeof p);
+  memcpy(&p, data, size < sizeof p ? size : sizeof p);
+
+  machine1.pc = machine2.pc = 0;
+#ifdef CONTROL_FLOW
+  init_control(&machine1);
+  init_control(&machine2);
+#endif
+  machine1.memory = memory1;
+  machine1.stack = stack1;
+  machine1.insns = insns1;
+  machine2.memory = memory2;
+  machine2.stack = stack2;
+  machine2.insns = insns2;
+
+#ifdef EMPTY_STACK
+  machine1.sp = machine2.sp = 0;
+#else
+  machine1.sp = machine2.sp = p.sp % STK_LENGTH;
+#endif
+  for (int i = 0; i < machine1.sp; i++) {
+    fuzz_atoms(p.stack[i], &stack1[i], &stack2[i]);
+  }
+  for (int i = 0; i < MEM_LENGTH; i++) {
+#ifdef ZERO_MEMORY
+    const Atom zero = {L, 0};
+    memory1[i] = memory2[i] = zero;
+#else
+    fuzz_atoms(p.memory[i], &memory1[i], &memory2[i]);
+#endif
+  }
+  for (int i = 0; i < PRG_LENGTH; i++) {
+    insns1[i].t = insns2[i].t = (InsnType) (p.opcodes[i] % INSN_TYPES);
+    fuzz_atoms(p.immediates[i], &insns1[i].immediate, &insns2[i].immediate);
+#ifdef CONTROL_FLOW
+    // In the range of the instruction, the same in both machines
+    if (insns1[i].t == BNZ || insns1[i].t == CALL) {
+      insns1[i].immediate.tag = L;
+      insns1[i].immediate.value = insns1[i].t == BNZ
+        ? p.immediates[i].value % (2*BNZ_RANGE + 1) - BNZ_RANGE
+        : p.immediates[i].value % (MAX_ARGS + 1);
+      insns2[i].immediate = insns1[i].immediate;
+    }
+#endif
+  }
+
+  machine1_.memory = memory1_;
+  machine1_.stack = stack1_;
+  machine1_.insns = insns1;
+  copy_machine(&machine1, &machine1_);
+  machine2_.memory = memory2_;
+  machine2_.stack = stack2_;
+  machine2_.insns = insns2;
+  copy_machine(&machine2, &machine2_);
+
+  if (run(&machine1) == ERRORED || run(&machine2) == ERRORED) {
+    return 0;
+  }
+  if (!indist_machine(&machine1, &machine2)) {
+    printf("*** Initial\n");
+    print_machine_pair(&machine1_, &machine2_);
+    printf("*** Final\n");
+    print_machine_pair(&machine1, &machine2);
+    fflush(stdout);
+    abort();
+  }
+  return 0;
+}
+
+// Provided by libFuzzer: its own mutations of raw bytes
+size_t LLVMFuzzerMutate(uint8_t *data, size_t size, size_t max_size);
+
+// Small values are memory addresses
+uint8_t fuzz_value(unsigned *seed) {
+  return rand_r(seed) % 4 ? rand_r(seed) % MEM_LENGTH : rand_r(seed) % 256;
+}
+
+void mutate_atom(FuzzAtom *a, unsigned *seed) {
+  switch (rand_r(seed) % 3) {
+    case 0:
+      a->tag ^= 1;
+      break;
+    case 1:
+      a->value = fuzz_value(seed);
+      break;
+    default:
+      a->hi = fuzz_value(seed);
+      break;
+  }
+}
+
+// Edits of the machines rather than of bytes: opcodes, immediates, tags,
+// values, insertion and deletion of instructions. The pair remains
+// indistinguishable, by construction.
+size_t LLVMFuzzerCustomMutator(uint8_t *data, size_t size, size_t max_size,
+                               unsigned seed) {
+  FuzzPair p;
+  if (max_size < sizeof p || rand_r(&seed) % 8 == 0) {
+    return LLVMFuzzerMutate(data, size, max_size);
+  }
+  memset(&p, 0, sizeof p);
+  memcpy(&p, data, size < sizeof p ? size : sizeof p);
+
+  for (int edits = 1 + rand_r(&seed) % 3; edits > 0; edits--) {
+    int i = rand_r(&seed) % PRG_LENGTH;
+    switch (rand_r(&seed) % 7) {
+      case 0:
+        p.opcodes[i] = rand_r(&seed) % INSN_TYPES;
+        break;
+      case 1:
+        p.opcodes[i] = PUSH;
+        mutate_atom(&p.immediates[i], &seed);
+        break;
+      case 2:
+        // Insert an instruction at i
+        memmove(&p.opcodes[i + 1], &p.opcodes[i], PRG_LENGTH - 1 - i);
+        memmove(&p.immediates[i + 1], &p.immediates[i],
+                (PRG_LENGTH - 1 - i) * sizeof *p.immediates);
+        p.opcodes[i] = rand_r(&seed) % INSN_TYPES;
+        mutate_atom(&p.immediates[i], &seed);
+        break;
+      case 3:
+        // Delete instruction i
+        memmove(&p.opcodes[i], &p.opcodes[i + 1], PRG_LENGTH - 1 - i);
+        memmove(&p.immediates[i], &p.immediates[i + 1],
+                (PRG_LENGTH - 1 - i) * sizeof *p.immediates);
+        p.opcodes[PRG_LENGTH - 1] = HALT;
+        break;
+      case 4:
+        p.sp = rand_r(&seed) % STK_LENGTH;
+        mutate_atom(&p.stack[rand_r(&seed) % STK_LENGTH], &seed);
+        break;
+      case 5:
+        mutate_atom(&p.memory[rand_r(&seed) % MEM_LENGTH], &seed);
+        break;
+      default:
+        mutate_atom(&p.stack[rand_r(&seed) % STK_LENGTH], &seed);
+        break;
+    }
+  }
+  memcpy(data, &p, sizeof p);
+  return sizeof p;
+}
 #endif